@@ -68,10 +68,11 @@ common:
 linux64:
 	# binary libraries, these will be usually parsed from the file system but some 
 	# libraries need to passed to the linker in a specific order 
-	#nothing yet
+	# zlib: gzip for the HTTP asset cache
+	ADDON_PKG_CONFIG_LIBRARIES = zlib
 	
 linux:
-	#nothing yet
+	ADDON_PKG_CONFIG_LIBRARIES = zlib
 	
 win_cb:
 	#nothing yet
@@ -103,6 +104,11 @@ vs:
 	# x64/Release 
 	# ADDON_LIBS  = libs/libwebsockets/lib/vs/x64/Release/websockets_static.lib
 	# ADDON_LIBS += libs/libwebsockets/lib/vs/x64/Release/ZLIB.lib
+	
+	# zlib: the HTTP asset cache only gzips files itself when the project
+	# links zlib (e.g. the ZLIB.lib above) and defines OFX_LWS_WITH_ZLIB;
+	# otherwise it serves .gz / .br files found next to the originals
+	# ADDON_DEFINES = OFX_LWS_WITH_ZLIB
 
 
 linuxarmv6l:
@@ -111,10 +117,18 @@ linuxarmv6l:
 	ADDON_LIBS = libs/libwebsockets/lib/linuxarmv6l/libwebsockets.a
 	ADDON_LIBS += libs/ssl/linuxarm6l/libssl.a
 	ADDON_LIBS += libs/ssl/linuxarm6l/libcrypto.a
+	# zlib: gzip for the HTTP asset cache
+	ADDON_PKG_CONFIG_LIBRARIES = zlib
 linuxarmv7l:
 	#ADDON_LDFLAGS = -lwebsockets -lssl
 	# ADDON_SOURCES_EXCLUDE = libs/libwebsockets/include/win32port/%
 	ADDON_LIBS = libs/libwebsockets/lib/linuxarmv7l/libwebsockets.a
+	# zlib: gzip for the HTTP asset cache
+	ADDON_PKG_CONFIG_LIBRARIES = zlib
+	
+msys2:
+	# zlib: gzip for the HTTP asset cache (pacman -S mingw-w64-x86_64-zlib)
+	ADDON_PKG_CONFIG_LIBRARIES = zlib
 	
 android/armeabi:	
 	#nothing yet
@@ -129,6 +143,8 @@ osx:
 	ADDON_INCLUDES 	+= libs/openssl/include
 	ADDON_LIBS 		+= libs/openssl/lib/osx/libcrypto.a
 	ADDON_LIBS 		+= libs/openssl/lib/osx/libssl.a
+	# zlib: gzip for the HTTP asset cache
+	ADDON_LDFLAGS 	+= -lz
 
 	# OpenSSL support for OSX 10.11+
 	# ADDON_INCLUDES += ../../../libs/openssl/include
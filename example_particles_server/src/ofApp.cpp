@@ -19,7 +19,8 @@ void ofApp::update(){
     
     // now, send position texture to clients
     posPingPong.src->readToPixels(sendPixels);
-    server.sendBinary((char *)sendPixels.getData(), sendPixels.size() * sendPixels.getBytesPerChannel() );
+    // conflated: a client that falls behind skips to the newest frame
+    server.sendBinaryConflated((char *)sendPixels.getData(), sendPixels.size() * sendPixels.getBytesPerChannel(), 1 );
 }
 
 //--------------------------------------------------------------
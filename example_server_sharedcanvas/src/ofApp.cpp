@@ -141,12 +141,11 @@ void ofApp::onMessage( ofxLibwebsockets::Event& args ){
     } else {
     }
     // send all that drawing back to everybody except this one
-    vector<ofxLibwebsockets::Connection *> connections = server.getConnections();
-    for ( int i=0; i<connections.size(); i++){
-        if ( (*connections[i]) != args.conn ){
-            connections[i]->send( args.message );
+    server.forEachConnection( [&args]( ofxLibwebsockets::Connection & conn ){
+        if ( conn != args.conn ){
+            conn.send( args.message );
         }
-    }
+    });
   }
   catch(exception& e){
     ofLogError() << e.what();
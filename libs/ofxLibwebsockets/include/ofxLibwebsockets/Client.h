@@ -22,6 +22,32 @@ namespace ofxLibwebsockets {
         bool    reconnect;
         int     reconnectInterval;
         
+        // service loop: false == poll lws every ~1ms (default)
+        // true == block in lws until there is socket activity or a send() wakes it up
+        bool    bEventDriven;
+        
+        // true == queue onConnect / onClose / onIdle / onMessage and deliver
+        // them on the main thread (ofEvents().update); see addBatchListener()
+        bool    bMainThreadEvents;
+        
+        // backpressure watermarks in bytes queued per connection (0 == off):
+        // past high a connection raises onBackpressure and its canSend()
+        // is false until it drains to low and raises onDrain
+        size_t  highWatermark;
+        size_t  lowWatermark;
+        
+        // buffer sizes for the main protocol (see Protocol::rx_buffer_size,
+        // tx_packet_size, max_fragment_size); set other protocols' directly
+        unsigned int rxBufferSize;
+        unsigned int txPacketSize;
+        unsigned int maxFragmentSize;
+        unsigned int minFragmentSize;
+        bool    bAdaptiveFragments;     // see Protocol::bAdaptiveFragments
+        
+        // permessage-deflate compression (off by default); worth it for
+        // JSON / text streams, see DeflateOptions for the memory it costs
+        DeflateOptions deflate;
+        
         // advanced: timeout options
         // names are from libwebsockets (ka == keep alive)
         int     ka_time;        // 0 == default, no timeout; nonzero == time to wait in seconds before testing conn
@@ -77,6 +103,35 @@ namespace ofxLibwebsockets {
             ofAddListener( clientProtocol.onmessageEvent, app, &T::onMessage);
         }
         
+        // main thread events only: get each update's messages in one call,
+        // void onMessageBatch( vector<ofxLibwebsockets::Event> & messages )
+        // (instead of onMessage while registered). Events are only valid
+        // during the call
+        template<class T>
+        void addBatchListener(T * app){
+            ofAddListener( clientProtocol.onmessagebatchEvent, app, &T::onMessageBatch);
+        }
+        
+        template<class T>
+        void removeBatchListener(T * app){
+            ofRemoveListener( clientProtocol.onmessagebatchEvent, app, &T::onMessageBatch);
+        }
+        
+        // backpressure (see ClientOptions::highWatermark):
+        // void onBackpressure( ofxLibwebsockets::Event & args )
+        // void onDrain( ofxLibwebsockets::Event & args )
+        template<class T>
+        void addBackpressureListener(T * app){
+            ofAddListener( clientProtocol.onbackpressureEvent, app, &T::onBackpressure);
+            ofAddListener( clientProtocol.ondrainEvent, app, &T::onDrain);
+        }
+        
+        template<class T>
+        void removeBackpressureListener(T * app){
+            ofRemoveListener( clientProtocol.onbackpressureEvent, app, &T::onBackpressure);
+            ofRemoveListener( clientProtocol.ondrainEvent, app, &T::onDrain);
+        }
+        
         // get pointer to libwebsockets connection wrapper
         Connection * getConnection(){
             return connection;
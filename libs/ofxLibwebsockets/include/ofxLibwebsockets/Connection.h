@@ -9,29 +9,75 @@
 
 #include "ofMain.h"
 #include <libwebsockets.h>
+#include "ofxLibwebsockets/MpscQueue.h"
 
 #include <iostream>
 #include <vector>
 #include <string>
+#include <list>
+#include <memory>
+#include <type_traits>
 
 namespace ofxLibwebsockets {
     
     class Reactor;
     class Protocol;
+    struct HttpResponse;
+    class HttpRequest;
+    
+    // stable handle to a connection; stays unique after the connection closes
+    typedef uint64_t ConnectionId;
+    #define OFX_LWS_INVALID_CONNECTION 0
+    
+    // conflation key: a queued message with the same (nonzero) key that
+    // hasn't started sending yet is replaced by the new one
+    #define OFX_LWS_NO_CONFLATION 0
     
     struct TextPacket {
         string message;
         int index;
+        unsigned int key;
+        uint64_t queuedAt;  // ofGetElapsedTimeMillis() when sent (slow consumer age)
     };
     
+    // immutable payload; a broadcast shares one of these between every
+    // connection's queue and it is freed when the last one is done sending
+    typedef std::shared_ptr<const unsigned char> SharedPayload;
+    
     struct BinaryPacket {
-        unsigned char * data;
+        SharedPayload data;
         unsigned int size;
         int index;
+        unsigned int key;
+        uint64_t queuedAt;
+    };
+    
+    // what to do with a client that can't keep up (see SlowConsumerPolicy)
+    enum SlowConsumerAction {
+        OFX_LWS_SLOW_CONSUMER_CLOSE,    // close it with closeCode / closeReason
+        OFX_LWS_SLOW_CONSUMER_DROP      // keep it open, drop everything it hasn't started receiving
+    };
+    
+    // a connection whose send queue stays over maxQueuedBytes, or whose
+    // oldest unsent message is older than maxQueuedMillis, for graceMillis
+    // in a row gets 'action'. both limits 0 == off (default)
+    struct SlowConsumerPolicy {
+        SlowConsumerPolicy()
+        : maxQueuedBytes(0), maxQueuedMillis(0), graceMillis(5000)
+        , action(OFX_LWS_SLOW_CONSUMER_CLOSE)
+        , closeCode(LWS_CLOSE_STATUS_POLICY_VIOLATION), closeReason("slow consumer"){}
+        
+        size_t  maxQueuedBytes;
+        int     maxQueuedMillis;
+        int     graceMillis;
+        SlowConsumerAction action;
+        int     closeCode;          // lws_close_status, sent in the close frame
+        std::string closeReason;    // max 123 bytes
     };
     
     class Connection {
         friend class Reactor;
+        friend class ConnectionRegistry;
     public:
         Connection(Reactor* const _reactor=NULL, Protocol* const _protocol=NULL);
         
@@ -51,11 +97,53 @@ namespace ofxLibwebsockets {
         void sendBinary( unsigned char * data, unsigned int size );
         void sendBinary( char * data, unsigned int size );
         
+        // queue a payload without copying it (see makePayload)
+        void sendBinary( const SharedPayload & data, unsigned int size );
+        
+        // copy data once into a payload that can be queued on many connections
+        static SharedPayload makePayload( const char * data, unsigned int size );
+        
+        // "latest value wins": replaces a message queued with the same key
+        // that hasn't started going out, so a slow client gets the newest
+        // frame instead of a growing backlog. key must be nonzero
+        void sendConflated( const std::string & message, unsigned int key );
+        void sendBinaryConflated( const SharedPayload & data, unsigned int size, unsigned int key );
+        
         // gets IP address *relative to system*
         // e.g. localhost could be ::1, 127.0.0.1, your IP, etc...
         std::string getClientIP();
         std::string getClientName();
         
+        // OFX_LWS_INVALID_CONNECTION until the connection is established;
+        // kept after it closes (Reactor::sendTo() simply won't find it)
+        ConnectionId getId() const { return id; }
+        
+        // backpressure: bytes / messages sent but not yet written to the socket
+        size_t getQueuedBytes() const { return queuedBytes; }
+        size_t getQueuedMessages() const { return queuedMessages; }
+        
+        // false while this connection is over the reactor's high watermark
+        // (between onBackpressure and onDrain); skip work for it if you can
+        bool canSend() const;
+        
+        // true once the slow consumer policy closed this connection;
+        // sends to it are ignored from then on
+        bool isEvicted() const { return bEvicted; }
+        
+        // size of the frames large messages are split into right now:
+        // Protocol::max_fragment_size, or with bAdaptiveFragments whatever
+        // suits this client's connection at the moment
+        int getFragmentSize() const { return bufferSize; }
+        
+        // how fast this client's socket takes data, in bytes / second.
+        // measured with bAdaptiveFragments only, while the socket is backed up;
+        // 0 until then
+        size_t getDrainRate() const { return drainRate; }
+        
+        // which of the server's lws contexts this connection was accepted
+        // on (see ServerOptions::shards); always 0 for clients
+        int getShard() const { return shard; }
+        
         
         void setupAddress();
         
@@ -73,25 +161,98 @@ namespace ofxLibwebsockets {
         bool isIdle();
         
     protected:
+        ConnectionId id;
         std::string client_ip;
         std::string client_name;
         
         bool binary;            // is this connection sending / receiving binary?
         
-        int bufferSize;
-        unsigned char* buf;
-        unsigned char* binaryBuf;
-        //std::vector<unsigned char> buf;
+        std::atomic<int> bufferSize;    // fragment size (see getFragmentSize())
+        int shard;              // lws context (Server shard) this connection lives on
+        int tsi;                // lws service thread this connection lives on
+        
+        // threading stuff: send() pushes onto the lock-free outboxes from
+        // any thread; the service thread moves them into the deques below,
+        // which it alone touches
+        MpscQueue<TextPacket> outbox_text;
+        MpscQueue<BinaryPacket> outbox_binary;
+        // (lists rather than deques: an empty list doesn't allocate)
+        std::list<TextPacket> messages_text;
+        std::list<BinaryPacket> messages_binary;
+        
+        // true while this connection's id sits in the reactor's pending list
+        std::atomic<bool> bScheduled;
+        std::atomic<bool> bIdleQueued;  // an idle event waits for the main thread
+        
+        std::atomic<size_t> queuedBytes;
+        std::atomic<size_t> queuedMessages;
+        std::atomic<bool> bBackpressured;
+        
+        // set by the service thread before it lets go of ws; senders on
+        // other threads check this instead of reading ws
+        std::atomic<bool> bClosed;
+        
+        // raise onBackpressure / onDrain when crossing the watermarks (service thread)
+        void checkWatermarks();
         
-        // threading stuff
-        std::deque<TextPacket> messages_text;
-        std::deque<BinaryPacket> messages_binary;
+        // apply the reactor's SlowConsumerPolicy (service thread; also on
+        // LWS_CALLBACK_TIMER, so a client that never drains still gets checked)
+        // returns true when the connection should close now, which only
+        // happens with bTimer (the caller returns nonzero to lws)
+        bool checkSlowConsumer( bool bTimer=false );
+        uint64_t stampQueued();
+        uint64_t queuedAge( uint64_t now );
+        void dropBacklog();
+        uint64_t slowSince;     // when the current stretch over the limits began, 0 == not over
+        std::atomic<bool> bEvicted;
+        
+        // service thread only
+        void drainOutbox();
+        template<class Packet>
+        void enqueue( std::list<Packet> & messages, Packet & packet );
+        bool hasPendingOutput();
         
         void setIdle( bool isIdle=true );
         
+        // fragment reassembly: a message that arrives in several
+        // frames or reads is collected here until the final fragment
+        bool bReceivingLargeMessage;
+        std::string largeMessage;   // text or binary bytes received so far
+        
+        // received while the Dispatcher was full (message, isBinary); rx is
+        // paused until they are queued (service thread)
+        std::list<std::pair<std::string, bool> > heldMessages;
+        
+        // bytesLeft == lws_remaining_packet_payload(), used to size the buffer
+        // once per frame. false if the message grows past
+        // Protocol::max_message_size (the bytes so far are dropped)
+        bool appendFragment( const char * data, size_t len, size_t bytesLeft );
+        
+        // write the next fragment of the front message
+        // returns the bytes written, 0 if nothing is queued, -1 on error
+        int writeFragment();
+        
+        // adaptive fragments: called after each pass of writes (service thread)
+        void adaptFragmentSize( size_t written, bool bChoked );
+        uint64_t windowMicros;      // start of the current drain rate window, 0 == socket not full
+        size_t windowBytes;
+        std::atomic<size_t> drainRate;
+        
     private:
         bool idle;
     };
     
+    // lws per-session data for server connections: lws allocates (and
+    // zeroes) one of these per socket, and the Connection is constructed
+    // in place on LWS_CALLBACK_ESTABLISHED and destroyed on
+    // LWS_CALLBACK_WSI_DESTROY. Don't keep Connection pointers around or
+    // use them off the service thread; keep getId() and send with
+    // Reactor::sendTo() instead.
+    struct ConnectionSession {
+        Connection * conn;  // NULL until established
+        std::aligned_storage<sizeof(Connection), alignof(Connection)>::type storage;
+        HttpResponse * http;    // plain HTTP: cached file being sent, if any
+        HttpRequest * request;  // plain HTTP: dynamic route being handled, if any
+    };
 
 }
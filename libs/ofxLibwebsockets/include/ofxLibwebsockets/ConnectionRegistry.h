@@ -0,0 +1,71 @@
+//
+//  ConnectionRegistry.h
+//  ofxLibwebsockets
+//
+//  Indexed set of live connections: a slot map keyed by a stable
+//  ConnectionId plus a secondary index by client IP. Add, remove and
+//  lookup are O(1); iteration walks a dense array and never allocates.
+//
+//  Not thread safe on its own; Reactor guards it with its mutex.
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+#include "ofxLibwebsockets/Connection.h"
+
+namespace ofxLibwebsockets {
+    
+    class ConnectionRegistry {
+    public:
+        typedef std::vector<Connection *>::const_iterator const_iterator;
+        
+        ConnectionRegistry();
+        
+        // assigns conn a new id and adds it; returns the id
+        ConnectionId add( Connection * conn );
+        
+        // returns false if conn wasn't registered
+        bool remove( Connection * conn );
+        
+        void clear();
+        
+        // NULL if the id is stale (connection closed) or unknown
+        Connection * get( ConnectionId id ) const;
+        bool contains( const Connection * conn ) const;
+        
+        // secondary index by client IP
+        bool hasIP( const std::string & ip ) const;
+        const std::vector<Connection *> & getByIP( const std::string & ip ) const;
+        
+        // dense iteration (order changes when connections are removed)
+        size_t size() const { return dense.size(); }
+        bool empty() const { return dense.empty(); }
+        Connection * operator[]( size_t index ) const { return dense[index]; }
+        const_iterator begin() const { return dense.begin(); }
+        const_iterator end() const { return dense.end(); }
+        
+        // copy out, e.g. for Reactor::getConnections()
+        const std::vector<Connection *> & asVector() const { return dense; }
+        
+    protected:
+        struct Slot {
+            Connection *    conn;
+            uint32_t        generation;   // bumped on every reuse so stale ids miss
+            uint32_t        denseIndex;
+            std::string     ip;           // key used in byIP when added
+        };
+        
+        std::vector<Slot>           slots;
+        std::vector<uint32_t>       freeSlots;
+        std::vector<Connection *>   dense;
+        
+        std::unordered_map<std::string, std::vector<Connection *> > byIP;
+        
+        static uint32_t slotOf( ConnectionId id ){ return (uint32_t)(id & 0xffffffff); }
+        static uint32_t generationOf( ConnectionId id ){ return (uint32_t)(id >> 32); }
+    };
+}
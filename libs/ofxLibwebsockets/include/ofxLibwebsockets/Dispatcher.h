@@ -0,0 +1,92 @@
+//
+//  Dispatcher.h
+//  ofxLibwebsockets
+//
+//  Optional worker pool for received messages, so slow onMessage handlers
+//  don't stall the lws service thread. Each connection has its own inbox
+//  and only one worker handles a connection at a time, so messages from
+//  one connection are delivered in order. The total number of queued
+//  messages is bounded: a message that doesn't fit stays with its
+//  connection and the Reactor pauses reading from it (lws rx flow control)
+//  until the queue has drained to half.
+//
+//  The service thread never waits for the workers: a connection that
+//  closes with messages still queued gets its onClose after them, and is
+//  deleted by the worker that handled the last one.
+//
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+
+namespace ofxLibwebsockets {
+
+    class Connection;
+    class Reactor;
+
+    class Dispatcher {
+    public:
+        Dispatcher();
+        ~Dispatcher();
+
+        void start( Reactor * reactor, int numThreads, size_t capacity );
+
+        // joins the workers after they finished everything queued
+        void stop();
+
+        bool isRunning() const { return workers.size() > 0; }
+
+        // queue a received message (service thread). false if the queue is
+        // full and payload wasn't taken: the caller keeps it and stops
+        // reading from conn until Reactor::_resumeRx(conn). bForce queues it
+        // anyway (the last messages of a closing connection)
+        bool push( Connection * conn, std::string && payload, bool isBinary, bool bForce = false );
+
+        // conn closed (service thread). true if messages for it are still
+        // queued: onClose is then delivered after them, by a worker
+        bool close( Connection * conn );
+
+        // lws is done with conn, a heap Connection (service thread). true if
+        // a worker still has it: that worker deletes it when it's done
+        bool release( Connection * conn );
+
+    protected:
+        struct Job {
+            std::string payload;
+            bool isBinary;
+        };
+
+        struct Inbox {
+            Inbox() : bScheduled(false), bThrottled(false), bClosed(false), bReleased(false){}
+            std::deque<Job> jobs;
+            bool bScheduled;    // in 'ready' or being handled by a worker
+            bool bThrottled;    // rx paused until the queue drains
+            bool bClosed;       // deliver onClose after the last job
+            bool bReleased;     // delete the connection after that
+        };
+
+        void work();
+
+        // queue drained to half: let paused connections read again
+        void resumeThrottled();
+
+        Reactor * reactor;
+        size_t capacity;
+        size_t queued;
+        size_t throttled;       // inboxes with bThrottled
+        bool bStopping;
+
+        std::mutex mutex;
+        std::condition_variable workAvailable;
+
+        std::unordered_map<Connection *, Inbox> inboxes;
+        std::deque<Connection *> ready;     // connections with work, round robin
+        std::vector<std::thread> workers;
+    };
+};
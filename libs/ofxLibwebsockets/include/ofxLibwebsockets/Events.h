@@ -8,22 +8,56 @@
 #pragma once 
 
 #include "ofMain.h"
+#include <string_view>
 
 namespace ofxLibwebsockets {
     
     class Connection;
 
     class Event {
+        friend class Reactor;
     public:
         Event(Connection& _conn, std::string _message, bool isBinary=false);
         
+        // a copy owns its message / data and its payload points at them;
+        // with Protocol::bCopyPayload off the copy's payload views the same
+        // bytes as the original and is only valid as long as that is.
+        // (not assignable: conn is a reference)
+        Event(const Event & other);
+        Event(Event && other) noexcept;
+        
         Connection& conn;
+        int shard;           // server shard conn lives on (see ServerOptions::shards)
         std::string message; // message from ws OR error message if error
+        
+        // message parsed as JSON (null if it isn't valid JSON). Filled in
+        // before your handler runs unless the protocol has bParseJSON off;
+        // then it stays null until you call parseJson()
         ofJson json;
         
+        // parses message into json on first call (never throws) and returns it
+        ofJson & parseJson();
+        
         // binary data
         bool isBinary;
         ofBuffer data;
+        
+        // non-owning view of the received bytes (text or binary). It points
+        // into the lws rx buffer or the connection's reassembly buffer, so
+        // it is only valid until your handler returns. Turn off
+        // Protocol::bCopyPayload to skip filling message / data and read
+        // large messages through this instead.
+        std::string_view payload;
+        
+        // moves the payload out of the event: no copy for a reassembled
+        // message, one copy for a message that arrived in a single read
+        std::string takePayload();
+        
+    protected:
+        void setPayloadFrom( std::string_view view, bool bOwnedByMessage );
+        
+        std::string * payloadOwner;     // buffer payload points into, if we may move it
+        bool bParsedJSON;
     };
 };
 
@@ -0,0 +1,86 @@
+//
+//  HttpCache.h
+//  ofxLibwebsockets
+//
+//  Keeps the files under a Server's documentRoot in memory, so pages are
+//  served without touching the disk: either all of them at setup or each
+//  one on its first request. Every file gets an ETag (a hash of its
+//  contents) for If-None-Match / 304 replies. With watching on, a cached
+//  file is checked for changes on disk at most once a second, when it is
+//  requested.
+//
+//  Compressed copies: a file.gz / file.br next to a file is used for
+//  clients that accept gzip / brotli (as long as it isn't older than the
+//  file). Text-like files with no .gz are gzipped once when loaded (when
+//  zlib is linked, see addon_config.mk).
+//
+//  Thread safe: several service threads may look files up at once.
+//
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+namespace ofxLibwebsockets {
+
+    class HttpCache {
+    public:
+        struct Asset {
+            std::string path;       // on disk
+            std::string body;
+            std::string etag;       // quoted, ready for the header
+            std::string mimetype;
+            std::string gzip;       // gzip encoded body, "" == none
+            std::string brotli;     // brotli encoded body (from a .br file), "" == none
+            int64_t     mtime;      // last write time when loaded
+            mutable std::atomic<uint64_t> checkedAt;    // ofGetElapsedTimeMillis() of the last look at the disk
+        };
+        typedef std::shared_ptr<const Asset> AssetPtr;
+
+        HttpCache();
+
+        // files bigger than maxFileSize are never cached (served from disk)
+        void setup( const std::string & documentRoot, bool bPreload, bool bWatch, size_t maxFileSize );
+        void clear();
+
+        // the cached file for a request path ("/index.html"), loading it
+        // if needed. NULL if it doesn't exist or is too big to cache
+        AssetPtr get( const std::string & url );
+
+        // full path of a request path under the document root; empty if
+        // the path tries to leave it ("..")
+        std::string pathFor( const std::string & url ) const;
+
+        // content type for a file extension ("css", "js"...), text/html if unknown
+        static const std::string & mimeType( const std::string & ext );
+        
+        // every extension (no dot) -> content type mimeType() knows
+        static const std::unordered_map<std::string, std::string> & mimeTypes();
+        
+        // does an Accept-Encoding header allow coding ("gzip", "br")?
+        static bool acceptsEncoding( const std::string & acceptEncoding, const std::string & coding );
+
+    protected:
+        AssetPtr load( const std::string & url, const std::string & path );
+        void loadEncodings( Asset & asset );
+        void preload( const std::string & dir, const std::string & url );
+
+        std::string documentRoot;
+        bool bWatch;
+        size_t maxFileSize;
+
+        std::mutex mutex;
+        std::unordered_map<std::string, AssetPtr> assets;  // by request path
+    };
+
+    // a cached file on its way out on one HTTP connection
+    struct HttpResponse {
+        HttpCache::AssetPtr asset;
+        const std::string * body;   // asset's body, gzip or brotli
+        size_t offset;
+    };
+};
@@ -0,0 +1,131 @@
+//
+//  HttpRoute.h
+//  ofxLibwebsockets
+//
+//  Dynamic HTTP endpoints served next to the websockets, on the same port
+//  and service thread (see Server::addRoute / onGet / onPost).
+//
+//  Request bodies are handed over as lws reads them: form fields
+//  (urlencoded or multipart) are decoded with lws-spa, uploaded files and
+//  any other body stream through HttpRoute::onBody a chunk at a time
+//  instead of being collected first.
+//
+//  A handler can respond() right away or keep the HttpRequestPtr and
+//  respond later from any thread; the response is written on the
+//  connection's writable callbacks.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+struct lws;
+struct lws_spa;
+
+namespace ofxLibwebsockets {
+
+    class Reactor;
+    class HttpRequest;
+    typedef std::shared_ptr<HttpRequest> HttpRequestPtr;
+
+    // a piece of a request body
+    struct HttpBodyChunk {
+        std::string field;      // multipart field it belongs to, "" == plain body
+        std::string filename;   // uploaded file's name, if any
+        const char * data;
+        size_t size;
+        bool bLast;             // the field / body is complete (size may be 0)
+    };
+
+    struct HttpRoute {
+        HttpRoute()
+        : maxBodySize(1024 * 1024){}
+
+        std::string method;     // "GET", "POST"...
+        std::string path;       // "/api/status"; a trailing '*' matches any path starting with it
+
+        // form fields to decode from POSTed forms, see HttpRequest::field()
+        std::vector<std::string> fields;
+
+        // streamed body (service thread): files uploaded in multipart forms
+        // and any body that isn't a form. if not set, such bodies are
+        // collected in HttpRequest::body up to maxBodySize (bigger ones
+        // get a 413) and uploaded files are skipped
+        std::function<void(HttpRequest &, const HttpBodyChunk &)> onBody;
+        size_t maxBodySize;
+
+        // the whole request is in (service thread): respond() now or later.
+        // not set == answer 204 No Content
+        std::function<void(HttpRequestPtr)> onRequest;
+
+        bool matches( const std::string & url ) const;
+    };
+
+    class HttpRequest : public std::enable_shared_from_this<HttpRequest> {
+        friend class Reactor;
+
+    public:
+        std::string method;
+        std::string path;       // without the query string
+        std::string body;       // see HttpRoute::onBody
+
+        // request headers by lower case name ("content-type"), query string
+        // arguments and decoded form fields; "" if missing
+        std::string header( const std::string & name ) const;
+        std::string arg( const std::string & name ) const;
+        std::string field( const std::string & name ) const;
+
+        const std::map<std::string, std::string> & getHeaders() const { return headers; }
+        const std::map<std::string, std::string> & getArgs() const { return args; }
+        const std::map<std::string, std::string> & getFields() const { return fields; }
+        const std::string & getClientIP() const { return clientIP; }
+
+        // extra response header, before respond()
+        void addHeader( const std::string & name, const std::string & value );
+
+        // answer the request, once; any thread
+        void respond( int status, const std::string & body = "", const std::string & contentType = "text/plain" );
+
+        bool isResponded();
+
+        // false once lws has closed the connection (it may only notice a
+        // client that went away when the response is written)
+        bool isOpen();
+
+    protected:
+        HttpRequest();
+
+        HttpRoute route;
+        std::map<std::string, std::string> headers;
+        std::map<std::string, std::string> args;
+        std::map<std::string, std::string> fields;
+        std::string clientIP;
+
+        // service thread only
+        struct lws * ws;            // NULL once the connection is gone
+        struct lws_spa * spa;       // form decoder while a form body arrives
+        std::vector<const char *> fieldNames;   // route.fields for spa
+        bool bTooLarge;
+        bool bHeadersSent;
+        size_t offset;
+        HttpRequestPtr self;        // the lws session's reference
+
+        Reactor * reactor;
+        int shard;
+        int tsi;
+
+        std::mutex mutex;
+        bool bHandled;              // onRequest returned: respond() has to wake the service thread
+        bool bResponded;
+        bool bClosed;
+        int status;
+        std::string contentType;
+        std::string responseBody;
+        std::vector<std::pair<std::string, std::string> > responseHeaders;
+    };
+};
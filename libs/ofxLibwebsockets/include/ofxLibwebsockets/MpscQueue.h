@@ -0,0 +1,71 @@
+//
+//  MpscQueue.h
+//  ofxLibwebsockets
+//
+//  Lock-free multi-producer / single-consumer queue (Vyukov's intrusive
+//  node queue). Any thread may push() without blocking; only one consumer
+//  thread (usually the service thread) may pop() or call empty().
+//
+
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace ofxLibwebsockets {
+    
+    template<class T>
+    class MpscQueue {
+    public:
+        MpscQueue()
+        : head(&stub), tail(&stub){
+            stub.next.store(NULL, std::memory_order_relaxed);
+        }
+        
+        ~MpscQueue(){
+            T value;
+            while ( pop(value) ){}
+            if ( tail != &stub ) delete tail;
+        }
+        
+        // any thread; never blocks
+        void push( T value ){
+            Node * node = new Node;
+            node->value = std::move(value);
+            node->next.store(NULL, std::memory_order_relaxed);
+            Node * prev = head.exchange(node, std::memory_order_acq_rel);
+            prev->next.store(node, std::memory_order_release);
+        }
+        
+        // consumer thread only; false if nothing is (fully) pushed yet
+        bool pop( T & value ){
+            Node * last = tail;
+            Node * next = last->next.load(std::memory_order_acquire);
+            if ( next == NULL ) return false;
+            
+            // next becomes the new (already consumed) stub
+            value = std::move(next->value);
+            tail = next;
+            if ( last != &stub ) delete last;
+            return true;
+        }
+        
+        // consumer thread only
+        bool empty() const {
+            return tail->next.load(std::memory_order_acquire) == NULL;
+        }
+        
+    private:
+        struct Node {
+            std::atomic<Node *> next;
+            T value;
+        };
+        
+        MpscQueue( const MpscQueue & );
+        MpscQueue & operator=( const MpscQueue & );
+        
+        Node                stub;
+        std::atomic<Node *> head;   // producers
+        Node *              tail;   // consumer
+    };
+}
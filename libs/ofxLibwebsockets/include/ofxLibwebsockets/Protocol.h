@@ -14,6 +14,9 @@
 #include "ofxLibwebsockets/Events.h"
 
 #define OFX_LWS_MAX_BUFFER 2048
+#define OFX_LWS_MAX_FRAGMENT 65536
+#define OFX_LWS_MIN_FRAGMENT 1024
+#define OFX_LWS_MAX_MESSAGE (64 * 1024 * 1024)
 
 namespace ofxLibwebsockets {
     
@@ -34,7 +37,39 @@ namespace ofxLibwebsockets {
                                  const std::string ip) const;
         
         unsigned int idx;
+        
+        // set these before the Server / Client is set up:
+        // rx_buffer_size:     lws receive buffer per connection (larger
+        //                     frames arrive in several reads)
+        // tx_packet_size:     most lws writes to the socket in one go
+        //                     (0 == max_fragment_size)
+        // max_fragment_size:  outgoing messages are split into frames of
+        //                     at most this many bytes
         unsigned int rx_buffer_size;
+        unsigned int tx_packet_size;
+        unsigned int max_fragment_size;
+        
+        // pick each connection's fragment size between min_fragment_size
+        // and max_fragment_size from how fast its socket drains: big
+        // fragments for fast clients, small ones for slow clients so a
+        // large message doesn't hold up the ones behind it for long.
+        // see Connection::getFragmentSize(). false by default
+        bool bAdaptiveFragments;
+        unsigned int min_fragment_size;
+        
+        // biggest message accepted from a peer, in bytes (64 MB by default);
+        // a connection sending (or announcing) more is closed with 1009
+        // "message too big"
+        size_t max_message_size;
+        
+        // parse text messages into Event::json before handlers run? (true by default)
+        // turn off for plain text or CSV streams; a handler can still call
+        // Event::parseJson() for the odd message it wants parsed
+        bool bParseJSON;
+        
+        // copy received payloads into Event::message / Event::data? (true by default)
+        // turn off to handle messages zero-copy through Event::payload / takePayload()
+        bool bCopyPayload;
         
     protected:  
         // override these methods if/when creating
@@ -55,6 +90,9 @@ namespace ofxLibwebsockets {
         ofEvent<Event> onerrorEvent;
         ofEvent<Event> onidleEvent;
         ofEvent<Event> onmessageEvent;
+        ofEvent<std::vector<Event> > onmessagebatchEvent;  // main thread events only
+        ofEvent<Event> onbackpressureEvent;
+        ofEvent<Event> ondrainEvent;
         
         bool defaultAllowPolicy;
         std::map<std::string, bool> allowRules;
@@ -12,11 +12,35 @@
 #include <libwebsockets.h>
 #include "ofxLibwebsockets/Protocol.h"
 #include "ofxLibwebsockets/Connection.h"
+#include "ofxLibwebsockets/ConnectionRegistry.h"
+#include "ofxLibwebsockets/Dispatcher.h"
+#include "ofxLibwebsockets/HttpCache.h"
+#include "ofxLibwebsockets/HttpRoute.h"
+#include <memory>
 
 namespace ofxLibwebsockets {
+    
+    // permessage-deflate (RFC 7692) settings, see ServerOptions / ClientOptions.
+    // only used if both sides agree, and only if libwebsockets was built
+    // with extensions (LWS_WITHOUT_EXTENSIONS not defined). clients offer
+    // them; a server answers whatever the client offers and applies them to
+    // what it sends (never with a bigger window than the client asked for)
+    struct DeflateOptions {
+        DeflateOptions()
+        : bEnabled(false), windowBits(12), memLevel(5), compressionLevel(6)
+        , bNoContextTakeover(false){}
+        
+        bool bEnabled;
+        int  windowBits;            // 9 - 15: window of 1 << windowBits bytes per direction
+        int  memLevel;              // 1 - 9: compressor state, about 1 << (memLevel + 9) bytes
+        int  compressionLevel;      // 1 (fast) - 9 (small)
+        bool bNoContextTakeover;    // start every message from scratch: worse
+                                    // ratio, nothing carried over between messages
+    };
         
     class Reactor : public ofThread {
         friend class Protocol;
+        friend class Connection;
         
     public:
         Reactor();
@@ -29,14 +53,53 @@ namespace ofxLibwebsockets {
         void registerProtocol(const std::string& name, Protocol& protocol);
         
         void setDuplicateConnections(bool val) { bAllowDuplicateConnections = val;}
+        
+        // backpressure: a connection with more than high bytes queued raises
+        // onBackpressure and canSend() turns false, until it's back down to
+        // low and raises onDrain. 0 == off (default)
+        void setWatermarks( size_t high, size_t low );
+        
+        // close or trim connections that stay too far behind (off by default)
+        void setSlowConsumerPolicy( const SlowConsumerPolicy & policy );
 
         // parse JSON automatically? (true by default)
+        // see Protocol::bParseJSON to turn it off per protocol
         bool bParseJSON;
         
         // getters
-        struct lws_context *    getContext();
+        struct lws_context *    getContext();   // first (usually only) lws context
+        int                     getNumShards();
+        
+        // raw Connection pointers: the service thread destroys a connection
+        // as soon as it closes, so only use these on the service thread (in
+        // onMessage etc.). from other threads, keep ids and use sendTo(),
+        // or forEachConnection()
         vector<Connection *>    getConnections();
         Connection *            getConnection( int index );
+        Connection *            getConnectionById( ConnectionId id );
+        
+        // send to one connection from any thread; false if it has closed.
+        // the connection is looked up and its message queued with the
+        // reactor locked, so it can't go away halfway
+        bool sendTo( ConnectionId id, const std::string & message, unsigned int key = OFX_LWS_NO_CONFLATION );
+        bool sendBinaryTo( ConnectionId id, const char * data, unsigned int size, unsigned int key = OFX_LWS_NO_CONFLATION );
+        bool sendBinaryTo( ConnectionId id, const SharedPayload & data, unsigned int size, unsigned int key = OFX_LWS_NO_CONFLATION );
+        
+        // call f(Connection&) on every open connection without copying
+        // the list; runs with the reactor locked, so don't close() from f
+        // (safe from any thread)
+        template<class F>
+        void forEachConnection( F f ){
+            lock();
+            for (ConnectionRegistry::const_iterator it = connections.begin(); it != connections.end(); ++it){
+                f( **it );
+            }
+            unlock();
+        }
+        
+        // deliver events queued for the main thread (see
+        // ServerOptions::bMainThreadEvents); runs on ofEvents().update
+        void drainEvents();
         
         Protocol* const protocol(const unsigned int idx);
         std::vector<std::pair<std::string, Protocol*> > protocols;
@@ -47,20 +110,75 @@ namespace ofxLibwebsockets {
         unsigned int _notify(Connection* conn, enum lws_callback_reasons const reason,
                              const char* const _message, const unsigned int len);
         
-        unsigned int _http(struct lws *ws, const char* const url);
+        // HTTP requests: session is the lws per session data (servers only),
+        // used to send cached files from memory over several callbacks
+        int _http(struct lws *ws, const char* const url, ConnectionSession * session = NULL);
+        int _httpWritable(struct lws *ws, ConnectionSession * session);
+        void _httpClosed(ConnectionSession * session);
+        std::string _httpHeader(struct lws *ws, enum lws_token_indexes token);
+        
+        // dynamic routes (see HttpRoute.h): false if no route has url's path
+        bool _httpRoute(struct lws *ws, const std::string & url, ConnectionSession * session, int & result);
+        int _httpBody(struct lws *ws, ConnectionSession * session, const char * data, size_t len);
+        int _httpBodyDone(struct lws *ws, ConnectionSession * session);
+        
+        // a request answered after its handler returned (any thread)
+        void _httpRespond(HttpRequestPtr request);
+        
+        // deliver a message / onClose the Dispatcher queued (worker thread)
+        void _dispatch( Connection * conn, std::string & payload, bool isBinary );
+        void _dispatchClose( Connection * conn );
+        
+        // conn closed: hand its held messages to the Dispatcher; true if
+        // it delivers onClose after them (service thread)
+        bool _closeInbox( Connection * conn );
+        
+        // create / destroy a server connection in its lws session memory
+        // (on the heap when events go to the main thread or a worker)
+        void _openSession( ConnectionSession * session, Protocol * protocol );
+        void _closeSession( ConnectionSession * session );
+        
+        // the Dispatcher has room again: let conn's service thread read from it
+        void _resumeRx( Connection * conn );
+        
+        // active set: send() puts its connection on the pending list once
+        // (any thread); the service thread then only visits those
+        // connections instead of every connection each tick
+        void _schedule( Connection * conn );
+        
+        // service thread tsi of a shard: update (polling) or ask for a
+        // writable callback (event driven) on every pending connection it owns
+        void _servicePending( int shard = 0, int tsi = 0 );
+        
+        // Reactor that owns the lws context of ws (NULL if none);
+        // O(1) through the context's user data
+        static Reactor * _reactorFor( struct lws *ws );
+        
+        // index of the shard (lws context) ws belongs to
+        static int _shardIndex( struct lws *ws );
         
         void setWaitMillis(int millis);
         
+        // padded (LWS_PRE) scratch buffer for lws_write, shared by every
+        // connection on one service thread; returns the start of the padding
+        unsigned char * _sendBuffer( size_t size, int shard = 0, int tsi = 0 );
+        
+        // interrupt a blocking lws_service() so queued sends go out
+        // (only does anything when running event driven)
+        void wake( int shard = 0 );
+        
+        // wake for one service thread's queues: coalesced, so a broadcast
+        // to many connections costs one wakeup per service pass
+        void wake( int shard, int tsi );
+        
     protected:
         std::string     document_root;
+        bool            bHttpCache;
+        HttpCache       httpCache;
+        std::vector<HttpRoute> routes;     // set up before the context is created
         unsigned int    waitMillis;
         std::string     interfaceStr;
-        
-        bool            bReceivingLargeMessage;
-        std::string     largeMessage;
-        
-        unsigned int    largeBinarySize;
-        ofBuffer        largeBinaryMessage;
+        bool            bEventDriven;
         
         virtual void threadedFunction(){}
         
@@ -72,10 +190,102 @@ namespace ofxLibwebsockets {
         
         std::vector<struct lws_protocols> lws_protocols;
         
-        vector<Connection *> connections;
+        ConnectionRegistry connections;
+        
+        // per service thread (lws tsi) state; only the owning thread
+        // touches sendBuffer or pops pendingOutput
+        struct ServiceState {
+            ServiceState() : wakePending(false), resumeCount(0){}
+            std::vector<unsigned char> sendBuffer;
+            std::atomic<bool> wakePending;          // see wake( shard, tsi )
+            MpscQueue<ConnectionId> pendingOutput;
+            MpscQueue<ConnectionId> resumeRx;       // see Dispatcher
+            MpscQueue<HttpRequestPtr> httpResponses;    // see _httpRespond
+            
+            // _servicePending's batch: ids popped, then the connections
+            // they resolve to (NULL == gone), looked up under one lock
+            std::vector<ConnectionId> ids;
+            std::vector<Connection *> batch;
+            size_t resumeCount;     // the first resumeCount are resumeRx ids
+        };
+        
+        // one lws context and its service threads. a Server can run several
+        // on the same port (ServerOptions::shards), a Client has one.
+        // the context's user pointer points back here
+        struct Shard {
+            Shard( Reactor * _reactor, int _index )
+            : reactor(_reactor), index(_index), context(NULL){}
+            
+            Reactor * reactor;
+            int index;
+            struct lws_context * context;
+            ServiceState serviceStates[LWS_MAX_SMP];
+        };
+        std::vector<std::unique_ptr<Shard> > shards;
+        
+        // create the lws context for a shard (adding the shard if needed);
+        // shard 0's context is also kept in 'context'
+        struct lws_context * createContext( struct lws_context_creation_info & info, int shard = 0 );
+        
+        // destroy every shard's context
+        void destroyContexts();
+        
+        // lws_extensions list for info.extensions (NULL == none)
+        const struct lws_extension * setupExtensions( const DeflateOptions & options );
+        DeflateOptions deflate;
+        std::string deflateOffer;
+        struct lws_extension extensions[2];
+        
+        // per connection deflate tuning, once the extension is negotiated
+        void applyDeflateOptions( Connection * conn, bool bServer );
+        
+        // route handler is done with a request (bodies are in)
+        void httpRequestReady( HttpRequest * request );
+        int httpRouteWritable( struct lws *ws, ConnectionSession * session );
+        void httpRelease( ConnectionSession * session );
+        
+        // lws-spa callback for uploaded files, data is the HttpRequest
+        static int httpUpload( void * data, const char * name, const char * filename,
+                               char * buf, int len, enum lws_spa_fileupload_states state );
+        
+        // write the next chunk of body from offset; -1 error, 0 more to come, 1 done
+        int httpWriteBody( struct lws *ws, const std::string & body, size_t & offset );
+        
+        // lws_protocols entry for protocols[i], with its buffer sizes
+        struct lws_protocols makeLwsProtocol( size_t i, lws_callback_function * callback, size_t perSessionSize );
+        
         bool bAllowDuplicateConnections;
         
+        size_t highWatermark;
+        size_t lowWatermark;
+        SlowConsumerPolicy slowConsumer;
+        
+        // runs onMessage on worker threads when started (see ServerOptions)
+        Dispatcher dispatcher;
+        
+        // events waiting for the main thread: queued lock-free by the
+        // service thread(s), popped by drainEvents() only
+        struct QueuedEvent {
+            enum Type { CONNECT, CLOSE, IDLE, MESSAGE, BACKPRESSURE, DRAIN, RELEASE };
+            Type type;
+            Connection * conn;
+            std::string payload;
+            bool isBinary;
+        };
+        bool bMainThreadEvents;
+        MpscQueue<QueuedEvent> queuedEvents;
+        std::vector<QueuedEvent> drainBuffer;
+        std::vector<Event> messageBatch;
+        
+        void setMainThreadEvents( bool bMainThread );
+        void _onUpdate( ofEventArgs & args );
+        
+        // notify now, or queue for the main thread
+        void _deliver( QueuedEvent::Type type, Connection * conn, Event & args );
+        void _queueEvent( QueuedEvent::Type type, Connection * conn, std::string && payload = std::string(), bool isBinary = false );
+        void _deliverMessages( QueuedEvent * events, size_t count );
+        
+        // fill in a message event from a payload it may take over
+        void _setPayload( Event & args, std::string & payload );
     };
-    
-    extern vector<Reactor *> reactors;
 };
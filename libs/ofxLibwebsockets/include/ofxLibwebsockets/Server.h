@@ -23,6 +23,27 @@ namespace ofxLibwebsockets {
 
     class Connection;
     class Protocol;
+    class ServiceThread;
+    
+    // a directory lws serves by itself: requests under urlPrefix never reach
+    // the http cache or LWS_CALLBACK_HTTP, lws streams the file from disk a
+    // chunk at a time, so any size works (recordings, video clips...).
+    // Range requests need libwebsockets built with LWS_WITH_RANGES
+    struct HttpMount {
+        HttpMount( const string & _urlPrefix = "", const string & _documentRoot = "" )
+        : urlPrefix(_urlPrefix), documentRoot(_documentRoot), defaultFile("index.html"),
+          cacheMaxAge(0), bCacheReusable(false), bCacheRevalidate(false), bCacheIntermediaries(false){}
+        
+        string  urlPrefix;          // e.g. "/clips"
+        string  documentRoot;       // directory it maps to
+        string  defaultFile;        // served for a directory, "" == none
+        
+        // Cache-Control; not reusable (default) == "no-store"
+        int     cacheMaxAge;        // seconds
+        bool    bCacheReusable;     // browsers may keep it for cacheMaxAge
+        bool    bCacheRevalidate;   // ...but must check it's still current
+        bool    bCacheIntermediaries;   // proxies may cache it too
+    };
     
     struct ServerOptions {
         int     port;               
@@ -33,6 +54,75 @@ namespace ofxLibwebsockets {
         
         string  documentRoot;       // where your hosted files are (libwebsockets sets up a minimal webserver)
         
+        // keep documentRoot's files in memory (with ETags, so browsers can
+        // revalidate with a 304) instead of reading them for every request
+        bool    bHttpCache;         // false by default
+        bool    bHttpPreload;       // load everything in setup() rather than on first request
+        bool    bHttpWatch;         // notice changed files, checked at most once a second (false by default)
+        size_t  httpCacheMaxFileSize;   // bigger files are streamed from disk
+        
+        // directories lws serves on its own (see HttpMount); checked before
+        // documentRoot, which still gets every other request
+        vector<HttpMount> mounts;
+        
+        // service loop: false == poll lws every ~1ms (default)
+        // true == block in lws until there is socket activity or a send() wakes it up
+        bool    bEventDriven;
+        
+        // true == queue onConnect / onClose / onIdle / onMessage and deliver
+        // them on the main thread (ofEvents().update), so handlers can touch
+        // GL and app state without locking. see addBatchListener().
+        // takes precedence over dispatchThreads
+        bool    bMainThreadEvents;
+        
+        // number of lws service threads (lws count_threads); connections are
+        // spread across them and each thread services its own share.
+        // onMessage etc. may then fire from several threads at once!
+        // needs libwebsockets built with LWS_MAX_SMP > 1, else it's clamped to 1
+        int     serviceThreads;
+        
+        // number of independent lws contexts listening on the same port
+        // (SO_REUSEPORT), each with its own service thread(s); the kernel
+        // spreads new connections across them. the Server still acts as one:
+        // send() / getConnections() cover every shard, Event::shard says
+        // which one an event came from. onMessage etc. may then fire from
+        // several threads at once! (Linux / BSD only)
+        int     shards;
+        
+        // > 0 == run onMessage on this many worker threads instead of the
+        // service thread, so a slow handler doesn't hold up other sockets.
+        // messages from one connection still arrive in order, and onClose
+        // comes after its last message. onMessage may then fire from
+        // several threads at once!
+        int     dispatchThreads;
+        
+        // max messages waiting for a worker; beyond that the server stops
+        // reading from the clients that sent more until half are handled
+        int     dispatchQueueSize;
+        
+        // backpressure watermarks in bytes queued per connection (0 == off):
+        // past high a connection raises onBackpressure and its canSend()
+        // is false until it drains to low and raises onDrain
+        size_t  highWatermark;
+        size_t  lowWatermark;
+        
+        // buffer sizes for the main protocol (see Protocol::rx_buffer_size,
+        // tx_packet_size, max_fragment_size); set other protocols' directly
+        unsigned int rxBufferSize;
+        unsigned int txPacketSize;
+        unsigned int maxFragmentSize;
+        unsigned int minFragmentSize;
+        bool    bAdaptiveFragments;     // see Protocol::bAdaptiveFragments
+        
+        // permessage-deflate compression (off by default); worth it for
+        // JSON / text streams, see DeflateOptions for the memory it costs
+        DeflateOptions deflate;
+        
+        // what to do with a client whose queue stays over a byte or age
+        // limit (a stuck browser tab...): close it with a close code and
+        // reason, or drop its backlog. off by default, see SlowConsumerPolicy
+        SlowConsumerPolicy slowConsumer;
+        
         // advanced: timeout options
         // names are from libwebsockets (ka == keep alive)
         int     ka_time;        // 0 == default, no timeout; nonzero == time to wait in seconds before testing conn
@@ -44,6 +134,7 @@ namespace ofxLibwebsockets {
 
     class Server : public Reactor {
         friend class Protocol;
+        friend class ServiceThread;
         
     public:
         Server();
@@ -66,20 +157,22 @@ namespace ofxLibwebsockets {
         template <class T> 
         void sendBinary( T& image ){
             int size = image.getWidth() * image.getHeight() * image.getPixels().getNumChannels();
-            
-            lock();
-            for (int i=0; i<connections.size(); i++){
-                if ( connections[i] != NULL ){
-                    connections[i]->sendBinary( (char *) image.getPixels().getData(), size );
-                }
-            }
-            unlock();
+            sendBinary( (char *) image.getPixels().getData(), size );
         }
         
         // send any binary data to all connections
         void sendBinary( ofBuffer & buffer );
         void sendBinary( unsigned char * data, int size );
         void sendBinary( char * data, int size );
+        void sendBinary( const SharedPayload & data, int size );
+        
+        // "latest value wins" versions for streams (video frames, state...):
+        // on each connection, replaces a message with the same nonzero key
+        // that hasn't started sending yet. slow clients get the newest one
+        // and a bounded queue, fast clients still get every one
+        void sendConflated( const string & message, unsigned int key );
+        void sendBinaryConflated( char * data, int size, unsigned int key );
+        void sendBinaryConflated( const SharedPayload & data, int size, unsigned int key );
         
         // send to a specific connection
         bool send( string message, string ip );
@@ -100,6 +193,47 @@ namespace ofxLibwebsockets {
             ofRemoveListener( serverProtocol.onmessageEvent, app, &T::onMessage);
         }
         
+        // main thread events only: get each update's messages in one call,
+        // void onMessageBatch( vector<ofxLibwebsockets::Event> & messages )
+        // (instead of onMessage while registered). Events are only valid
+        // during the call
+        template<class T>
+        void addBatchListener(T * app){
+            ofAddListener( serverProtocol.onmessagebatchEvent, app, &T::onMessageBatch);
+        }
+        
+        template<class T>
+        void removeBatchListener(T * app){
+            ofRemoveListener( serverProtocol.onmessagebatchEvent, app, &T::onMessageBatch);
+        }
+        
+        // backpressure (see ServerOptions::highWatermark):
+        // void onBackpressure( ofxLibwebsockets::Event & args )
+        // void onDrain( ofxLibwebsockets::Event & args )
+        template<class T>
+        void addBackpressureListener(T * app){
+            ofAddListener( serverProtocol.onbackpressureEvent, app, &T::onBackpressure);
+            ofAddListener( serverProtocol.ondrainEvent, app, &T::onDrain);
+        }
+        
+        template<class T>
+        void removeBackpressureListener(T * app){
+            ofRemoveListener( serverProtocol.onbackpressureEvent, app, &T::onBackpressure);
+            ofRemoveListener( serverProtocol.ondrainEvent, app, &T::onDrain);
+        }
+        
+        // dynamic HTTP endpoints on the server's port (see HttpRoute.h);
+        // add them before setup(). handlers run on the service thread
+        void addRoute( const HttpRoute & route );
+        void onGet( const string & path, std::function<void(HttpRequestPtr)> handler );
+        
+        // fields: form fields to decode, see HttpRoute::fields
+        void onPost( const string & path, std::function<void(HttpRequestPtr)> handler,
+                     const vector<string> & fields = vector<string>() );
+        
+        // internal: accept what's waiting on a shard's listen socket
+        void _acceptShared( struct lws *ws );
+        
         //getters
         int     getPort();
         string  getProtocol();
@@ -112,5 +246,15 @@ namespace ofxLibwebsockets {
     private:
         Protocol serverProtocol;
         void threadedFunction();  
+        
+        // runs lws_service_tsi() for one service thread until it is stopped
+        void serviceLoop( int shard, int tsi, ofThread & thread );
+        
+        // every service thread but shard 0 / tsi 0 (that one is this ofThread)
+        std::vector<ServiceThread *> extraServiceThreads;
+        
+        // lws versions of defaultOptions.mounts (pointing into its strings)
+        std::vector<struct lws_http_mount> lwsMounts;
+        void setupMounts( struct lws_context_creation_info & info );
     };
 };
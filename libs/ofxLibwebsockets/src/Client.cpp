@@ -25,6 +25,16 @@ namespace ofxLibwebsockets {
        // reconnect option. Use at your own risk!
        opts.reconnect = true;
        opts.reconnectInterval = 1000;
+       opts.bEventDriven = false;
+       opts.bMainThreadEvents = false;
+       opts.highWatermark = 0;
+       opts.lowWatermark = 0;
+       opts.rxBufferSize = OFX_LWS_MAX_BUFFER;
+       opts.txPacketSize = 0;
+       opts.maxFragmentSize = OFX_LWS_MAX_FRAGMENT;
+       opts.minFragmentSize = OFX_LWS_MIN_FRAGMENT;
+       opts.bAdaptiveFragments = false;
+       opts.deflate = DeflateOptions();
 
        opts.ka_time      = 0;
        opts.ka_probes    = 0;
@@ -36,7 +46,6 @@ namespace ofxLibwebsockets {
         context = NULL;
         connection = NULL;
         waitMillis = 1;
-        reactors.push_back(this);
         
         defaultOptions = defaultClientOptions();
 
@@ -77,6 +86,9 @@ namespace ofxLibwebsockets {
         path = options.path;
         defaultOptions = options;
         bShouldReconnect = defaultOptions.reconnect;
+        bEventDriven = defaultOptions.bEventDriven;
+        setMainThreadEvents( defaultOptions.bMainThreadEvents );
+        setWatermarks( defaultOptions.highWatermark, defaultOptions.lowWatermark );
 
 		/*
 			enum lws_log_levels {
@@ -100,18 +112,18 @@ namespace ofxLibwebsockets {
         struct lws_protocols null_protocol = { NULL, NULL, 0 };
         
         // setup the default protocol (the one that works when you do addListener())
+        clientProtocol.rx_buffer_size = options.rxBufferSize;
+        clientProtocol.tx_packet_size = options.txPacketSize;
+        clientProtocol.max_fragment_size = options.maxFragmentSize;
+        clientProtocol.min_fragment_size = options.minFragmentSize;
+        clientProtocol.bAdaptiveFragments = options.bAdaptiveFragments;
         registerProtocol( options.protocol, clientProtocol );  
         
         lws_protocols.clear();
         for (int i=0; i<protocols.size(); ++i)
         {
-            struct lws_protocols lws_protocol = {
-                ( protocols[i].first == "NULL" ? NULL : protocols[i].first.c_str() ),
-                lws_client_callback,
-                protocols[i].second->rx_buffer_size,
-                protocols[i].second->rx_buffer_size
-            };
-            lws_protocols.push_back(lws_protocol);
+            // the client owns its one Connection: no per session data
+            lws_protocols.push_back( makeLwsProtocol(i, lws_client_callback, 0) );
         }
         lws_protocols.push_back(null_protocol);
 
@@ -119,6 +131,7 @@ namespace ofxLibwebsockets {
         memset(&info, 0, sizeof info);
         info.port = CONTEXT_PORT_NO_LISTEN;
         info.protocols = &lws_protocols[0];
+        info.extensions = setupExtensions( defaultOptions.deflate );
         info.gid = -1;
         info.uid = -1;
         
@@ -129,7 +142,7 @@ namespace ofxLibwebsockets {
             info.ka_interval = options.ka_interval;
         }
 
-        context = lws_create_context(&info);
+        context = createContext(info);
 
         if (context == NULL){
             ofLogError() << "[ofxLibwebsockets] libwebsocket init failed";
@@ -153,6 +166,10 @@ namespace ofxLibwebsockets {
             ccinfo.protocol = NULL;
             ccinfo.method = NULL;
             ccinfo.pwsi = &lwsconnection;
+            
+            // lws_client_callback finds the Connection through this
+            connection = new Connection( this, &clientProtocol );
+            ccinfo.opaque_user_data = connection;
 
             // register with or without a protocol
             if ( options.protocol != "NULL"){
@@ -171,9 +188,10 @@ namespace ofxLibwebsockets {
                         
             if ( lwsconnection == NULL ){
                 ofLogError("ofxLibwebsockets") << "Client connection failed";
+                delete connection;
+                connection = NULL;
                 return false;
             } else {
-                connection = new Connection( (Reactor*) &context, &clientProtocol );
                 connection->ws = lwsconnection;                
                 
                 ofLogNotice("Client") << "Initiating connection to "  << ccinfo.address << " port: " << ccinfo.port << " path: "+options.path+" SSL: "+ofToString(options.bUseSSL);
@@ -207,16 +225,22 @@ namespace ofxLibwebsockets {
 
         if (isThreadRunning()){
             stopThread();
+            // kick the service thread out of its poll wait so it sees the stop flag
+            if ( context != NULL ) lws_cancel_service(context);
             ofSleepMillis(10);
             waitForThread(false,5000);
             ofLogNotice("Server") << "Thread stopped...";
         }
 
         if ( context != NULL ){
-            lws_context_destroy( context );
-            context = NULL;        
+            destroyContexts();
             lwsconnection = NULL;
         }
+        lock();
+        connections.clear();
+        unlock();
+        // queued events still point at the connection
+        drainEvents();
 		if ( connection != NULL){
             delete connection;
 			connection = NULL;                
@@ -280,14 +304,20 @@ namespace ofxLibwebsockets {
                 }
             }
             if (context != NULL && lwsconnection != NULL){
-                connection->update();
+                // in event driven mode writes only happen from the writable callback
+                if ( !bEventDriven ){
+                    connection->update();
+                }
                 
-                if (lock())
-                {
-                    int n = lws_service(context, -1);
-                    unlock();
+                // 0 == sleep until socket activity or lws_cancel_service()
+                // -1 == return immediately
+                int n = lws_service(context, bEventDriven ? 0 : -1);
+                if(n < 0) {
+                    ofLogError() << "lws_service returned an error: " << n;
+                }
+                if ( !bEventDriven ){
+                    ofSleepMillis(1);
                 }
-                ofSleepMillis(1);
             }
         }
     }
@@ -16,22 +16,35 @@ namespace ofxLibwebsockets {
     : reactor(_reactor)
     , protocol(_protocol)
     , ws(NULL)
-    //, buf(LWS_SEND_BUFFER_PRE_PADDING+1024+LWS_SEND_BUFFER_POST_PADDING)
+    , id(OFX_LWS_INVALID_CONNECTION)
+    , bufferSize(OFX_LWS_MAX_FRAGMENT)
+    , shard(0)
+    , tsi(0)
+    , bScheduled(false)
+    , bIdleQueued(false)
+    , queuedBytes(0)
+    , queuedMessages(0)
+    , bBackpressured(false)
+    , bClosed(false)
+    , slowSince(0)
+    , bEvicted(false)
+    , windowMicros(0)
+    , windowBytes(0)
+    , drainRate(0)
     {
+        // the padded send buffer is shared by the reactor's service thread,
+        // so a connection only keeps its queues and a little state
         if (_protocol != NULL){
-            bufferSize = _protocol->rx_buffer_size;
-            buf = (unsigned char*)calloc(LWS_SEND_BUFFER_PRE_PADDING+bufferSize+LWS_SEND_BUFFER_POST_PADDING, sizeof(unsigned char));
-            binaryBuf = (unsigned char*)calloc(LWS_SEND_BUFFER_PRE_PADDING+bufferSize+LWS_SEND_BUFFER_POST_PADDING, sizeof(unsigned char));
+            bufferSize = _protocol->max_fragment_size;
         }
         idle = false;
+        bReceivingLargeMessage = false;
     }
     
     //--------------------------------------------------------------
     Connection::~Connection(){
         ofLogNotice() << "Connection destructor...";
         close();
-        free(buf);
-        free(binaryBuf);
         
         // delete all pending frames
         messages_binary.clear();
@@ -41,8 +54,17 @@ namespace ofxLibwebsockets {
     void Connection::close() {
         // delete all pending frames
         ofLogNotice() << "Closing connection...";
+        for (std::list<TextPacket>::iterator it = messages_text.begin(); it != messages_text.end(); ++it){
+            queuedBytes -= it->message.size() - it->index;
+        }
+        for (std::list<BinaryPacket>::iterator it = messages_binary.begin(); it != messages_binary.end(); ++it){
+            queuedBytes -= it->size - it->index;
+        }
+        queuedMessages -= messages_text.size() + messages_binary.size();
         messages_binary.clear();
         messages_text.clear();
+        std::string().swap(largeMessage);
+        bReceivingLargeMessage = false;
 //        if (reactor != NULL){
 //            reactor->close(this);
 //        }
@@ -73,13 +95,31 @@ namespace ofxLibwebsockets {
     //--------------------------------------------------------------
     void Connection::send(const std::string& message)
     {
-        if ( ws == NULL) return;
+        sendConflated( message, OFX_LWS_NO_CONFLATION );
+    }
+    
+    //--------------------------------------------------------------
+    uint64_t Connection::stampQueued(){
+        // only pay for the clock when someone looks at message age
+        if ( reactor == NULL || reactor->slowConsumer.maxQueuedMillis <= 0 ) return 0;
+        return ofGetElapsedTimeMillis();
+    }
+    
+    //--------------------------------------------------------------
+    void Connection::sendConflated( const std::string & message, unsigned int key ){
+        if ( bClosed || bEvicted ) return;
         if ( message.size() == 0 ) return;
         
         TextPacket tp;
         tp.index = 0;
+        tp.key = key;
+        tp.queuedAt = stampQueued();
         tp.message = message;
-        messages_text.push_back(tp);
+        queuedBytes += message.size();
+        queuedMessages++;
+        outbox_text.push(tp);
+        
+        if ( reactor != NULL ) reactor->_schedule(this);
     }
     
     //--------------------------------------------------------------
@@ -94,35 +134,304 @@ namespace ofxLibwebsockets {
     
     //--------------------------------------------------------------
     void Connection::sendBinary( char * data, unsigned int size ){
-        int n = -1;
-        
         // changed 3/6/15: buffer all messages to prevent threading errors
-        // we have a big frame, so we need to send a few times
-        //        if ( bufferSize < size ){
+        // copy data into a payload, in case user frees it
+        sendBinary( makePayload(data, size), size );
+    }
+    
+    //--------------------------------------------------------------
+    void Connection::sendBinary( const SharedPayload & data, unsigned int size ){
+        sendBinaryConflated( data, size, OFX_LWS_NO_CONFLATION );
+    }
+    
+    //--------------------------------------------------------------
+    void Connection::sendBinaryConflated( const SharedPayload & data, unsigned int size, unsigned int key ){
+        if ( bClosed || bEvicted ) return;
+        if ( !data || size == 0 ) return;
         
         // need to split into packets
         BinaryPacket bp;
         bp.index = 0;
+        bp.key = key;
+        bp.queuedAt = stampQueued();
         bp.size = size;
+        bp.data = data;
         
-        // copy data into array, in case user frees it
-        bp.data = (unsigned char*)calloc(size, sizeof(unsigned char));
-        memcpy(bp.data, data, size);
+        queuedBytes += size;
+        queuedMessages++;
+        outbox_binary.push(bp);
         
-        messages_binary.push_back(bp);
+        if ( reactor != NULL ) reactor->_schedule(this);
+    }
+    
+    //--------------------------------------------------------------
+    SharedPayload Connection::makePayload( const char * data, unsigned int size ){
+        unsigned char * copy = new unsigned char[size];
+        memcpy(copy, data, size);
+        return SharedPayload(copy, std::default_delete<unsigned char[]>());
     }
     
     //--------------------------------------------------------------
     void Connection::update(){
-
-        // process standard ws messages
-        if ( messages_text.size() > 0 && idle ){
-
+        
+        drainOutbox();
+        
+        if ( !idle ){
+            // still waiting on a writable callback
+            if ( hasPendingOutput() ){
+                lws_callback_on_writable(ws);
+            }
+            checkWatermarks();
+            checkSlowConsumer();
+            return;
+        }
+        
+        // keep writing fragments (and whole messages) until the socket
+        // is full, instead of one fragment per writable callback
+        size_t written = 0;
+        bool bChoked = false;
+        while ( !(bChoked = lws_send_pipe_choked(ws)) ){
+            int n = writeFragment();
+            if ( n <= 0 ) break;    // nothing left to send, or write failed (lws will close us)
+            written += n;
+        }
+        if ( written > 0 && protocol != NULL && protocol->bAdaptiveFragments ){
+            adaptFragmentSize( written, bChoked );
+        }
+        
+        // only ask lws to call us back if there is more to send; an
+        // empty connection stays idle and costs nothing until send()
+        if ( hasPendingOutput() ){
+            // this sets the protocol to wait until "idle"
+            idle = false;
+            lws_callback_on_writable(ws);
+        }
+        checkWatermarks();
+        checkSlowConsumer();
+    }
+    
+    //--------------------------------------------------------------
+    // adaptive fragments aim for frames that take about this long to go out
+    static const uint64_t fragmentTargetMicros = 10000;
+    // and measure the drain rate over windows of at least this long
+    static const uint64_t drainWindowMicros = 100000;
+    
+    //--------------------------------------------------------------
+    void Connection::adaptFragmentSize( size_t written, bool bChoked ){
+        uint64_t now = ofGetElapsedTimeMicros();
+        
+        // bytes written per second only says how fast the socket drains
+        // while we keep it full; the client reads in bursts, so average
+        // over a window rather than from one writable callback to the next
+        if ( !bChoked ){
+            windowMicros = 0;
+        } else if ( windowMicros == 0 ){
+            windowMicros = now;
+            windowBytes = 0;
+        } else {
+            windowBytes += written;
+            if ( now - windowMicros >= drainWindowMicros ){
+                size_t sample = windowBytes * 1000000 / (now - windowMicros);
+                drainRate = drainRate == 0 ? sample : (drainRate * 3 + sample) / 4;
+                windowMicros = now;
+                windowBytes = 0;
+            }
+        }
+        
+        size_t size = bufferSize;
+        if ( !bChoked ){
+            // everything went out and there is still room: go bigger
+            if ( written >= size ) size *= 2;
+        } else if ( drainRate > 0 ){
+            size = drainRate * fragmentTargetMicros / 1000000;
+        } else if ( written <= size ){
+            // full after one fragment, and no measurement yet
+            size /= 2;
+        }
+        size_t maxSize = protocol->max_fragment_size;
+        size_t minSize = std::min( (size_t) protocol->min_fragment_size, maxSize );
+        bufferSize = (int) std::max( minSize, std::min(size, maxSize) );
+    }
+    
+    //--------------------------------------------------------------
+    bool Connection::canSend() const {
+        return !bBackpressured;
+    }
+    
+    //--------------------------------------------------------------
+    void Connection::checkWatermarks(){
+        size_t high = reactor->highWatermark;
+        if ( high == 0 || protocol == NULL ) return;
+        
+        static string dum ="";
+        if ( !bBackpressured && queuedBytes >= high ){
+            bBackpressured = true;
+            Event args(*this, dum);
+            reactor->_deliver(Reactor::QueuedEvent::BACKPRESSURE, this, args);
+        } else if ( bBackpressured && queuedBytes <= reactor->lowWatermark ){
+            bBackpressured = false;
+            Event args(*this, dum);
+            reactor->_deliver(Reactor::QueuedEvent::DRAIN, this, args);
+        }
+    }
+    
+    //--------------------------------------------------------------
+    bool Connection::checkSlowConsumer( bool bTimer ){
+        const SlowConsumerPolicy & policy = reactor->slowConsumer;
+        if ( policy.maxQueuedBytes == 0 && policy.maxQueuedMillis <= 0 ) return false;
+        if ( bEvicted || ws == NULL ) return false;
+        
+        uint64_t now = ofGetElapsedTimeMillis();
+        bool bOver = ( policy.maxQueuedBytes > 0 && queuedBytes >= policy.maxQueuedBytes ) ||
+                     ( policy.maxQueuedMillis > 0 && queuedAge(now) >= (uint64_t) policy.maxQueuedMillis );
+        
+        if ( !bOver ){
+            if ( slowSince != 0 ){
+                slowSince = 0;
+                lws_set_timer_usecs( ws, LWS_SET_TIMER_USEC_CANCEL );
+            }
+            return false;
+        }
+        
+        // a stuck client gets no more writable callbacks, so a timer
+        // brings us back when the grace period is up
+        uint64_t grace = std::max( policy.graceMillis, 0 );
+        if ( slowSince == 0 ){
+            slowSince = now;
+            lws_set_timer_usecs( ws, grace * 1000 );
+            return false;
+        }
+        if ( now - slowSince < grace ){
+            if ( bTimer ) lws_set_timer_usecs( ws, (grace - (now - slowSince)) * 1000 );
+            return false;
+        }
+        
+        if ( policy.action == OFX_LWS_SLOW_CONSUMER_DROP ){
+            ofLogWarning("ofxLibwebsockets") << "Slow consumer " << client_ip << ": dropping "
+                << queuedMessages << " queued messages (" << queuedBytes << " bytes)";
+            slowSince = 0;
+            lws_set_timer_usecs( ws, LWS_SET_TIMER_USEC_CANCEL );
+            dropBacklog();
+            checkWatermarks();
+            return false;
+        }
+        
+        // closing needs a nonzero return from a callback on this socket:
+        // outside the timer callback, ask for it to fire right away
+        if ( !bTimer ){
+            lws_set_timer_usecs( ws, 0 );
+            return false;
+        }
+        
+        ofLogWarning("ofxLibwebsockets") << "Slow consumer " << client_ip << ": closing with "
+            << queuedMessages << " queued messages (" << queuedBytes << " bytes)";
+        bEvicted = true;
+        close();    // frees the backlog now rather than when lws gets round to it
+        lws_close_reason( ws, (enum lws_close_status) policy.closeCode,
+                          (unsigned char *) policy.closeReason.data(),
+                          std::min( policy.closeReason.size(), (size_t) 123 ) );
+        return true;
+    }
+    
+    //--------------------------------------------------------------
+    uint64_t Connection::queuedAge( uint64_t now ){
+        // queues are in send order and a conflated replacement keeps its
+        // slot's stamp, so the fronts are the oldest
+        uint64_t oldest = now;
+        if ( messages_text.size() > 0 && messages_text.front().queuedAt != 0 ){
+            oldest = std::min( oldest, messages_text.front().queuedAt );
+        }
+        if ( messages_binary.size() > 0 && messages_binary.front().queuedAt != 0 ){
+            oldest = std::min( oldest, messages_binary.front().queuedAt );
+        }
+        return now - oldest;
+    }
+    
+    //--------------------------------------------------------------
+    void Connection::dropBacklog(){
+        // a message that has started going out must finish, or the
+        // client's framing breaks; everything behind it goes
+        std::list<TextPacket>::iterator t = messages_text.begin();
+        if ( t != messages_text.end() && t->index > 0 ) ++t;
+        while ( t != messages_text.end() ){
+            queuedBytes -= t->message.size();
+            queuedMessages--;
+            t = messages_text.erase( t );
+        }
+        std::list<BinaryPacket>::iterator b = messages_binary.begin();
+        if ( b != messages_binary.end() && b->index > 0 ) ++b;
+        while ( b != messages_binary.end() ){
+            queuedBytes -= b->size;
+            queuedMessages--;
+            b = messages_binary.erase( b );
+        }
+    }
+    
+    //--------------------------------------------------------------
+    void Connection::drainOutbox(){
+        TextPacket tp;
+        while ( outbox_text.pop(tp) ){
+            enqueue( messages_text, tp );
+        }
+        BinaryPacket bp;
+        while ( outbox_binary.pop(bp) ){
+            enqueue( messages_binary, bp );
+        }
+    }
+    
+    //--------------------------------------------------------------
+    static size_t packetSize( const TextPacket & packet ){ return packet.message.size(); }
+    static size_t packetSize( const BinaryPacket & packet ){ return packet.size; }
+    
+    //--------------------------------------------------------------
+    template<class Packet>
+    void Connection::enqueue( std::list<Packet> & messages, Packet & packet ){
+        if ( packet.key != OFX_LWS_NO_CONFLATION ){
+            // only untouched messages can be replaced; one that has started
+            // going out (index > 0) must finish
+            for (typename std::list<Packet>::iterator it = messages.begin(); it != messages.end(); ++it){
+                if ( it->key == packet.key && it->index == 0 ){
+                    queuedBytes -= packetSize(*it);
+                    queuedMessages--;
+                    // the slot has been waiting since the first one
+                    uint64_t queuedAt = it->queuedAt;
+                    *it = std::move(packet);
+                    it->queuedAt = queuedAt;
+                    return;
+                }
+            }
+        }
+        messages.push_back( std::move(packet) );
+    }
+    
+    //--------------------------------------------------------------
+    bool Connection::hasPendingOutput(){
+        return messages_text.size() > 0 || messages_binary.size() > 0 ||
+               !outbox_text.empty() || !outbox_binary.empty();
+    }
+    
+    //--------------------------------------------------------------
+    int Connection::writeFragment(){
+        // a fragmented message must go out whole before the next one
+        // starts, so finish whatever is in progress first
+        bool bText = messages_text.size() > 0;
+        bool bBinary = messages_binary.size() > 0;
+        if ( bText && bBinary ){
+            bText = messages_text.front().index > 0 || messages_binary.front().index == 0;
+        } else if ( !bText && !bBinary ){
+            return 0;
+        }
+        
+        // one size for the whole fragment, even if adaptive sizing changes it
+        size_t fragment = (size_t) bufferSize.load();
+        size_t dataSize;
+        
+        if ( bText ){
             // grab first packet
-            TextPacket & packet = messages_text[0];
+            TextPacket & packet = messages_text.front();
             
             // either send a part of the message or just the message itself
-            int dataSize = bufferSize > packet.message.size() ? packet.message.size() : bufferSize;
+            dataSize = fragment > packet.message.size() ? packet.message.size() : fragment;
             
             // if "start" set 'write text'; otherwise we're sending a continuation
             int writeMode = packet.index == 0 ? LWS_WRITE_TEXT : LWS_WRITE_CONTINUATION;
@@ -130,7 +439,7 @@ namespace ofxLibwebsockets {
             bool bDone = false;
             
             // are we going to write the whole packet here?
-            if ( packet.index + dataSize >= packet.message.size() ){
+            if ( (size_t) packet.index + dataSize >= packet.message.size() ){
                 dataSize = packet.message.size() - packet.index;
                 bDone = true;
             } else {
@@ -138,74 +447,92 @@ namespace ofxLibwebsockets {
             }
             
             // actual write to libwebsockets
+            unsigned char * buf = reactor->_sendBuffer( dataSize, shard, tsi );
             memcpy(&buf[LWS_SEND_BUFFER_PRE_PADDING], packet.message.c_str() + packet.index, dataSize );
-            idle = false;
             
             int n = lws_write(ws, &buf[LWS_SEND_BUFFER_PRE_PADDING], dataSize, (lws_write_protocol) writeMode );
             
-            if ( n < -1 ){
+            if ( n < 0 ){
                 ofLogError("ofxLibwebsockets")<< "Error writing to socket";
+                return -1;
             }
             
-            lws_callback_on_writable(ws);
             packet.index += dataSize;
+            queuedBytes -= dataSize;
             
             // packet sent completed, erase front of dequeue
             if ( bDone ){
                 messages_text.pop_front();
+                queuedMessages--;
             }
+        } else {
+            ofLogVerbose() << "Process binary message...";
+            BinaryPacket & packet = messages_binary.front();
             
-        } else if ( messages_text.size() > 0 && messages_text[0].index ){
-            ofLogNotice() << "lws_callback_on_writable() called";
-            lws_callback_on_writable(ws);
+            dataSize = fragment > packet.size ? packet.size : fragment;
+            int writeMode = packet.index == 0 ? LWS_WRITE_BINARY : LWS_WRITE_CONTINUATION;
+            
+            bool bDone = false;
+            if ( (size_t) packet.index + dataSize >= packet.size ){
+                dataSize = packet.size - packet.index;
+                bDone = true;
+            } else {
+                writeMode |= LWS_WRITE_NO_FIN; // add "we're not finished" flag
+            }
+            
+            unsigned char * buf = reactor->_sendBuffer( dataSize, shard, tsi );
+            memcpy(&buf[LWS_SEND_BUFFER_PRE_PADDING], packet.data.get() + packet.index, dataSize );
+            
+            int n = lws_write(ws, &buf[LWS_SEND_BUFFER_PRE_PADDING], dataSize, (lws_write_protocol) writeMode );
+            
+            if ( n < 0 ){
+                ofLogError()<<"[ofxLibwebsockets] ERROR writing to socket";
+                return -1;
+            }
+            
+            packet.index += dataSize;
+            queuedBytes -= dataSize;
+            
+            if ( bDone ){
+                messages_binary.pop_front();
+                queuedMessages--;
+            }
+        }
+        return dataSize;
+    }
+    //--------------------------------------------------------------
+    bool Connection::appendFragment( const char * data, size_t len, size_t bytesLeft ){
+        // bytesLeft is what the frame header claims, nothing received yet:
+        // check it against the limit before allocating for it
+        size_t limit = protocol->max_message_size;
+        if ( len > limit - largeMessage.size() || bytesLeft > limit - largeMessage.size() - len ){
+            std::string().swap(largeMessage);
+            bReceivingLargeMessage = false;
+            return false;
         }
         
-        // process binary messages
-        if ( messages_binary.size() > 0 && idle ){
-            if ( messages_binary.size() > 0 ){
-                ofLogVerbose() << "Process binary message...";
-                BinaryPacket & packet = messages_binary[0];
-            
-                int dataSize = bufferSize > packet.size ? packet.size : bufferSize;
-                int writeMode = packet.index == 0 ? LWS_WRITE_BINARY : LWS_WRITE_CONTINUATION;
-                
-                bool bDone = false;
-                if ( packet.index + dataSize >= packet.size ){
-                    dataSize = packet.size - packet.index;
-                    bDone = true;
-                } else {
-                    writeMode |= LWS_WRITE_NO_FIN; // add "we're not finished" flag
-                }
-                
-                memcpy(&binaryBuf[LWS_SEND_BUFFER_PRE_PADDING], packet.data + packet.index, dataSize );
-                
-                // this sets the protocol to wait until "idle"
-                idle = false; // todo: this should be automatic on write!
-                
-                int n = lws_write(ws, &binaryBuf[LWS_SEND_BUFFER_PRE_PADDING], dataSize, (lws_write_protocol) writeMode );
-                lws_callback_on_writable(ws);
-                packet.index += dataSize;
-                
-                if ( n < -1 ){
-                    ofLogError()<<"[ofxLibwebsockets] ERROR writing to socket";
-                }
-                
-                if ( bDone ){
-                    free(packet.data);
-                    messages_binary.pop_front();
-                }
-            }
-        } else if ( messages_binary.size() > 0 && messages_binary[0].index ){
-            lws_callback_on_writable(ws);
+        // make room for the rest of this frame up front, so a large frame
+        // is collected with one allocation instead of growing per read
+        size_t needed = largeMessage.size() + len + bytesLeft;
+        if ( needed > largeMessage.capacity() ){
+            largeMessage.reserve( std::min( std::max(needed, largeMessage.capacity() * 2), limit ) );
         }
+        if ( data != NULL && len > 0 ){
+            largeMessage.append( data, len );
+        }
+        bReceivingLargeMessage = true;
+        return true;
     }
+    
     //--------------------------------------------------------------
     void Connection::setIdle( bool isIdle ){
         idle = isIdle;
         static string dum ="";
         if ( protocol != NULL ){
+            // writable callbacks come often: keep one idle event queued at most
+            if ( reactor->bMainThreadEvents && bIdleQueued.exchange(true) ) return;
             Event args(*this, dum);
-            ofNotifyEvent(protocol->onidleEvent, args);
+            reactor->_deliver(Reactor::QueuedEvent::IDLE, this, args);
         }
     }
     
@@ -0,0 +1,117 @@
+//
+//  ConnectionRegistry.cpp
+//  ofxLibwebsockets
+//
+
+#include "ofxLibwebsockets/ConnectionRegistry.h"
+
+namespace ofxLibwebsockets {
+    
+    //--------------------------------------------------------------
+    ConnectionRegistry::ConnectionRegistry(){
+    }
+    
+    //--------------------------------------------------------------
+    ConnectionId ConnectionRegistry::add( Connection * conn ){
+        if ( conn == NULL ) return OFX_LWS_INVALID_CONNECTION;
+        if ( contains(conn) ) return conn->id;
+        
+        uint32_t index;
+        if ( freeSlots.size() > 0 ){
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            index = (uint32_t) slots.size();
+            Slot slot;
+            slot.conn = NULL;
+            slot.generation = 0;
+            slot.denseIndex = 0;
+            slots.push_back(slot);
+        }
+        
+        Slot & slot = slots[index];
+        slot.conn = conn;
+        slot.generation++;
+        slot.denseIndex = (uint32_t) dense.size();
+        slot.ip = conn->getClientIP();
+        dense.push_back(conn);
+        byIP[slot.ip].push_back(conn);
+        
+        conn->id = ((ConnectionId) slot.generation << 32) | index;
+        return conn->id;
+    }
+    
+    //--------------------------------------------------------------
+    bool ConnectionRegistry::remove( Connection * conn ){
+        if ( !contains(conn) ) return false;
+        
+        Slot & slot = slots[ slotOf(conn->id) ];
+        
+        // swap the last connection into the hole
+        Connection * last = dense.back();
+        dense[slot.denseIndex] = last;
+        slots[ slotOf(last->id) ].denseIndex = slot.denseIndex;
+        dense.pop_back();
+        
+        std::unordered_map<std::string, std::vector<Connection *> >::iterator it = byIP.find(slot.ip);
+        if ( it != byIP.end() ){
+            std::vector<Connection *> & same = it->second;
+            for (size_t i=0; i<same.size(); i++){
+                if ( same[i] == conn ){
+                    same[i] = same.back();
+                    same.pop_back();
+                    break;
+                }
+            }
+            if ( same.empty() ) byIP.erase(it);
+        }
+        
+        // conn keeps its id: events still queued for it (main thread,
+        // Dispatcher) report the id onConnect had, and the slot's next
+        // generation won't match it
+        freeSlots.push_back( slotOf(conn->id) );
+        slot.conn = NULL;
+        slot.ip.clear();
+        return true;
+    }
+    
+    //--------------------------------------------------------------
+    void ConnectionRegistry::clear(){
+        for (size_t i=0; i<dense.size(); i++){
+            dense[i]->id = OFX_LWS_INVALID_CONNECTION;
+        }
+        freeSlots.clear();
+        for (size_t i=0; i<slots.size(); i++){
+            slots[i].conn = NULL;
+            slots[i].ip.clear();
+            freeSlots.push_back( (uint32_t) i );
+        }
+        dense.clear();
+        byIP.clear();
+    }
+    
+    //--------------------------------------------------------------
+    Connection * ConnectionRegistry::get( ConnectionId id ) const {
+        uint32_t index = slotOf(id);
+        if ( id == OFX_LWS_INVALID_CONNECTION || index >= slots.size() ) return NULL;
+        const Slot & slot = slots[index];
+        return slot.generation == generationOf(id) ? slot.conn : NULL;
+    }
+    
+    //--------------------------------------------------------------
+    bool ConnectionRegistry::contains( const Connection * conn ) const {
+        return conn != NULL && get(conn->id) == conn;
+    }
+    
+    //--------------------------------------------------------------
+    bool ConnectionRegistry::hasIP( const std::string & ip ) const {
+        return byIP.find(ip) != byIP.end();
+    }
+    
+    //--------------------------------------------------------------
+    const std::vector<Connection *> & ConnectionRegistry::getByIP( const std::string & ip ) const {
+        static const std::vector<Connection *> none;
+        std::unordered_map<std::string, std::vector<Connection *> >::const_iterator it = byIP.find(ip);
+        return it == byIP.end() ? none : it->second;
+    }
+}
@@ -0,0 +1,188 @@
+//
+//  Dispatcher.cpp
+//  ofxLibwebsockets
+//
+
+#include "ofxLibwebsockets/Dispatcher.h"
+#include "ofxLibwebsockets/Reactor.h"
+
+namespace ofxLibwebsockets {
+
+    //--------------------------------------------------------------
+    Dispatcher::Dispatcher()
+    : reactor(NULL), capacity(0), queued(0), throttled(0), bStopping(false){
+    }
+
+    //--------------------------------------------------------------
+    Dispatcher::~Dispatcher(){
+        stop();
+    }
+
+    //--------------------------------------------------------------
+    void Dispatcher::start( Reactor * _reactor, int numThreads, size_t _capacity ){
+        stop();
+
+        reactor = _reactor;
+        capacity = std::max( _capacity, (size_t) 1 );
+        bStopping = false;
+        for (int i=0; i<numThreads; i++){
+            workers.push_back( std::thread(&Dispatcher::work, this) );
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Dispatcher::stop(){
+        if ( workers.empty() ) return;
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            bStopping = true;
+        }
+        workAvailable.notify_all();
+        for (size_t i=0; i<workers.size(); i++){
+            workers[i].join();
+        }
+        workers.clear();
+
+        // the workers handled everything queued, but a connection may still
+        // be paused waiting for room, or be waiting to be deleted
+        std::lock_guard<std::mutex> guard(mutex);
+        for (std::unordered_map<Connection *, Inbox>::iterator it = inboxes.begin(); it != inboxes.end(); ++it){
+            if ( it->second.bReleased ){
+                delete it->first;
+            } else if ( it->second.bThrottled ){
+                reactor->_resumeRx( it->first );
+            }
+        }
+        inboxes.clear();
+        ready.clear();
+        queued = 0;
+        throttled = 0;
+    }
+
+    //--------------------------------------------------------------
+    bool Dispatcher::push( Connection * conn, std::string && payload, bool isBinary, bool bForce ){
+        std::lock_guard<std::mutex> guard(mutex);
+
+        Inbox & inbox = inboxes[conn];
+        if ( queued >= capacity && !bForce ){
+            if ( !inbox.bThrottled ){
+                inbox.bThrottled = true;
+                throttled++;
+            }
+            return false;
+        }
+
+        inbox.jobs.push_back( Job() );
+        inbox.jobs.back().payload.swap( payload );
+        inbox.jobs.back().isBinary = isBinary;
+        queued++;
+
+        if ( !inbox.bScheduled ){
+            inbox.bScheduled = true;
+            ready.push_back( conn );
+            workAvailable.notify_one();
+        }
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    bool Dispatcher::close( Connection * conn ){
+        std::lock_guard<std::mutex> guard(mutex);
+
+        std::unordered_map<Connection *, Inbox>::iterator it = inboxes.find( conn );
+        if ( it == inboxes.end() ) return false;
+
+        Inbox & inbox = it->second;
+        if ( inbox.bThrottled ){
+            inbox.bThrottled = false;
+            throttled--;
+        }
+        if ( !inbox.bScheduled ){
+            inboxes.erase( it );
+            return false;
+        }
+        inbox.bClosed = true;
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    bool Dispatcher::release( Connection * conn ){
+        std::lock_guard<std::mutex> guard(mutex);
+
+        std::unordered_map<Connection *, Inbox>::iterator it = inboxes.find( conn );
+        if ( it == inboxes.end() ) return false;
+
+        if ( !it->second.bScheduled ){
+            inboxes.erase( it );
+            return false;
+        }
+        it->second.bReleased = true;
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    void Dispatcher::resumeThrottled(){
+        for (std::unordered_map<Connection *, Inbox>::iterator it = inboxes.begin(); it != inboxes.end(); ++it){
+            if ( it->second.bThrottled ){
+                it->second.bThrottled = false;
+                reactor->_resumeRx( it->first );
+            }
+        }
+        throttled = 0;
+    }
+
+    //--------------------------------------------------------------
+    void Dispatcher::work(){
+        std::unique_lock<std::mutex> guard(mutex);
+
+        while ( true ){
+            workAvailable.wait( guard, [this]{ return bStopping || !ready.empty(); } );
+            if ( ready.empty() ) return;
+
+            // one message per turn, then the connection goes to the back of
+            // the line: ordered per connection, fair across connections.
+            // inbox references stay valid, nothing erases a scheduled one
+            Connection * conn = ready.front();
+            ready.pop_front();
+            Inbox & inbox = inboxes[conn];
+            if ( !inbox.jobs.empty() ){
+                Job job;
+                job.payload.swap( inbox.jobs.front().payload );
+                job.isBinary = inbox.jobs.front().isBinary;
+                inbox.jobs.pop_front();
+
+                guard.unlock();
+                reactor->_dispatch( conn, job.payload, job.isBinary );
+                guard.lock();
+
+                queued--;
+                if ( throttled > 0 && queued <= capacity / 2 ){
+                    resumeThrottled();
+                }
+            }
+
+            if ( !inbox.jobs.empty() ){
+                ready.push_back( conn );
+                workAvailable.notify_one();
+                continue;
+            }
+
+            // all delivered: now the connection's onClose, if it's gone
+            if ( inbox.bClosed ){
+                inbox.bClosed = false;
+                guard.unlock();
+                reactor->_dispatchClose( conn );
+                guard.lock();
+            }
+
+            inbox.bScheduled = false;
+            if ( inbox.bReleased ){
+                inboxes.erase( conn );
+                guard.unlock();
+                delete conn;
+                guard.lock();
+            }
+        }
+    }
+};
@@ -6,13 +6,97 @@
 //
 
 #include "ofxLibwebsockets/Events.h"
+#include "ofxLibwebsockets/Connection.h"
 
 namespace ofxLibwebsockets {
         
     //--------------------------------------------------------------
     Event::Event(Connection& _conn, std::string _message, bool isBinary)
     : conn(_conn)
+    , shard(_conn.getShard())
     , message(_message)
     , isBinary(isBinary)
+    , payloadOwner(NULL)
+    , bParsedJSON(false)
     {}
-}
\ No newline at end of file
+    
+    //--------------------------------------------------------------
+    Event::Event(const Event & other)
+    : conn(other.conn)
+    , shard(other.shard)
+    , message(other.message)
+    , json(other.json)
+    , isBinary(other.isBinary)
+    , data(other.data)
+    , payloadOwner(NULL)
+    , bParsedJSON(other.bParsedJSON)
+    {
+        setPayloadFrom( other.payload, other.payloadOwner == &other.message );
+    }
+    
+    //--------------------------------------------------------------
+    Event::Event(Event && other) noexcept
+    : conn(other.conn)
+    , shard(other.shard)
+    , json(std::move(other.json))
+    , isBinary(other.isBinary)
+    , payloadOwner(NULL)
+    , bParsedJSON(other.bParsedJSON)
+    {
+        // note where the payload pointed before its storage moves
+        std::string_view view = other.payload;
+        bool bOwned = other.payloadOwner == &other.message;
+        message.swap( other.message );
+        data = std::move( other.data );
+        setPayloadFrom( view, bOwned );
+        
+        other.payload = std::string_view();
+        other.payloadOwner = NULL;
+    }
+    
+    //--------------------------------------------------------------
+    void Event::setPayloadFrom( std::string_view view, bool bOwnedByMessage ){
+        // message / data hold a copy of the payload when the protocol copies
+        // it, so point at ours rather than at the other event's
+        payloadOwner = NULL;
+        if ( view.size() > 0 && !isBinary && message.size() == view.size() ){
+            payload = std::string_view(message);
+            if ( bOwnedByMessage ) payloadOwner = &message;
+        } else if ( view.size() > 0 && isBinary && data.size() == view.size() ){
+            payload = std::string_view(data.getData(), data.size());
+        } else {
+            payload = view;
+        }
+    }
+    
+    //--------------------------------------------------------------
+    ofJson & Event::parseJson(){
+        if ( !bParsedJSON ){
+            bParsedJSON = true;
+            // message is empty when the protocol doesn't copy payloads
+            std::string_view text = message.size() > 0 ? std::string_view(message) : payload;
+            if ( !isBinary && text.size() > 0 ){
+                // non-throwing parse: invalid input comes back "discarded"
+                json = ofJson::parse( text.begin(), text.end(), nullptr, false );
+                if ( json.is_discarded() ){
+                    ofLogVerbose() << "[ofxLibwebsockets] Message is not JSON";
+                    json = ofJson();
+                }
+            }
+        }
+        return json;
+    }
+    
+    //--------------------------------------------------------------
+    std::string Event::takePayload(){
+        std::string ret;
+        if ( payloadOwner != NULL ){
+            ret.swap( *payloadOwner );
+            payloadOwner = NULL;
+        } else {
+            ret.assign( payload.data(), payload.size() );
+        }
+        payload = std::string_view();
+        return ret;
+    }
+}
@@ -0,0 +1,293 @@
+//
+//  HttpCache.cpp
+//  ofxLibwebsockets
+//
+
+#include "ofxLibwebsockets/HttpCache.h"
+#include "ofMain.h"
+
+#include <filesystem>
+#include <fstream>
+#include <cstdio>
+
+// Visual Studio projects don't link zlib (see addon_config.mk): define
+// OFX_LWS_WITH_ZLIB when yours does. without it only .gz / .br files on
+// disk are served compressed
+#if defined(_MSC_VER) && !defined(OFX_LWS_WITH_ZLIB)
+#define OFX_LWS_NO_ZLIB
+#endif
+
+#if !defined(OFX_LWS_NO_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace ofxLibwebsockets {
+
+    //--------------------------------------------------------------
+    static int64_t lastWriteTime( const std::string & path ){
+        std::error_code error;
+        std::filesystem::file_time_type t = std::filesystem::last_write_time( path, error );
+        return error ? -1 : (int64_t) t.time_since_epoch().count();
+    }
+
+    //--------------------------------------------------------------
+    static bool readFile( const std::string & path, std::string & contents ){
+        std::ifstream file( path.c_str(), std::ios::in | std::ios::binary );
+        if ( !file ) return false;
+        file.seekg( 0, std::ios::end );
+        contents.resize( (size_t) file.tellg() );
+        file.seekg( 0, std::ios::beg );
+        file.read( &contents[0], contents.size() );
+        contents.resize( file.gcount() );
+        return true;
+    }
+    
+    //--------------------------------------------------------------
+    // gzip data in one go; false if it fails or doesn't get smaller
+    static bool gzipCompress( const std::string & data, std::string & compressed ){
+#if defined(OFX_LWS_NO_ZLIB)
+        return false;
+#else
+        z_stream stream;
+        memset(&stream, 0, sizeof stream);
+        // 15 + 16: biggest window, gzip header
+        if ( deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK ){
+            return false;
+        }
+        compressed.resize( deflateBound(&stream, data.size()) );
+        stream.next_in = (Bytef *) data.data();
+        stream.avail_in = data.size();
+        stream.next_out = (Bytef *) &compressed[0];
+        stream.avail_out = compressed.size();
+        int result = deflate(&stream, Z_FINISH);
+        compressed.resize( stream.total_out );
+        deflateEnd(&stream);
+        
+        if ( result != Z_STREAM_END || compressed.size() >= data.size() ){
+            compressed.clear();
+            return false;
+        }
+        return true;
+#endif
+    }
+    
+    //--------------------------------------------------------------
+    // worth gzipping: text, scripts, json, svg...
+    static bool isCompressible( const std::string & mimetype ){
+        return mimetype.compare(0, 5, "text/") == 0 ||
+               mimetype == "application/javascript" ||
+               mimetype == "application/json" ||
+               mimetype == "application/xml" ||
+               mimetype == "application/wasm" ||
+               mimetype == "image/svg+xml" ||
+               mimetype == "image/x-icon" ||
+               mimetype == "font/ttf" ||
+               mimetype == "font/otf";
+    }
+    
+    // smaller files aren't worth the Content-Encoding
+    static const size_t minCompressSize = 1024;
+    
+    //--------------------------------------------------------------
+    HttpCache::HttpCache()
+    : bWatch(false), maxFileSize(0){
+    }
+
+    //--------------------------------------------------------------
+    void HttpCache::setup( const std::string & _documentRoot, bool bPreload, bool _bWatch, size_t _maxFileSize ){
+        clear();
+        documentRoot = _documentRoot;
+        bWatch = _bWatch;
+        maxFileSize = _maxFileSize;
+
+        if ( bPreload ){
+            preload( documentRoot, "" );
+            ofLogVerbose("ofxLibwebsockets") << "Cached " << assets.size() << " files from " << documentRoot;
+        }
+    }
+
+    //--------------------------------------------------------------
+    void HttpCache::clear(){
+        std::lock_guard<std::mutex> guard(mutex);
+        assets.clear();
+    }
+
+    //--------------------------------------------------------------
+    void HttpCache::preload( const std::string & dir, const std::string & url ){
+        std::error_code error;
+        for (std::filesystem::directory_iterator it(dir, error), end; !error && it != end; it.increment(error)){
+            std::string name = it->path().filename().string();
+            if ( it->is_directory(error) ){
+                preload( it->path().string(), url + "/" + name );
+            } else {
+                get( url + "/" + name );
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    std::string HttpCache::pathFor( const std::string & url ) const {
+        if ( url.empty() || url[0] != '/' ) return "";
+
+        // refuse a ".." segment (either slash), but not names like "a..b.js"
+        size_t start = 1;
+        while ( start <= url.size() ){
+            size_t end = url.find_first_of( "/\\", start );
+            if ( end == std::string::npos ) end = url.size();
+            if ( url.compare( start, end - start, ".." ) == 0 ) return "";
+            start = end + 1;
+        }
+        return documentRoot + url;
+    }
+
+    //--------------------------------------------------------------
+    HttpCache::AssetPtr HttpCache::get( const std::string & url ){
+        AssetPtr asset;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            std::unordered_map<std::string, AssetPtr>::iterator it = assets.find( url );
+            if ( it != assets.end() ) asset = it->second;
+        }
+
+        if ( asset ){
+            if ( !bWatch ) return asset;
+
+            // look at the disk at most once a second per file
+            uint64_t now = ofGetElapsedTimeMillis();
+            if ( now - asset->checkedAt < 1000 ) return asset;
+            if ( lastWriteTime(asset->path) == asset->mtime ){
+                asset->checkedAt = now;
+                return asset;
+            }
+            ofLogVerbose("ofxLibwebsockets") << "Reloading changed file " << asset->path;
+        }
+
+        std::string path = pathFor( url );
+        if ( path.empty() ) return AssetPtr();
+        return load( url, path );
+    }
+
+    //--------------------------------------------------------------
+    HttpCache::AssetPtr HttpCache::load( const std::string & url, const std::string & path ){
+        std::error_code error;
+        if ( !std::filesystem::is_regular_file( path, error ) ){
+            std::lock_guard<std::mutex> guard(mutex);
+            assets.erase( url );
+            return AssetPtr();
+        }
+        uintmax_t size = std::filesystem::file_size( path, error );
+        if ( error || size > maxFileSize ) return AssetPtr();
+
+        std::shared_ptr<Asset> asset = std::make_shared<Asset>();
+        asset->path = path;
+        asset->mtime = lastWriteTime( path );
+        asset->checkedAt = ofGetElapsedTimeMillis();
+
+        if ( !readFile( path, asset->body ) ) return AssetPtr();
+
+        char etag[48];
+        snprintf( etag, sizeof etag, "\"%zx-%zx\"", asset->body.size(), std::hash<std::string>()(asset->body) );
+        asset->etag = etag;
+
+        size_t dot = url.find_last_of('.');
+        size_t slash = url.find_last_of('/');
+        asset->mimetype = mimeType( dot != std::string::npos && (slash == std::string::npos || dot > slash) ? url.substr(dot + 1) : "" );
+        loadEncodings( *asset );
+
+        std::lock_guard<std::mutex> guard(mutex);
+        assets[url] = asset;
+        return asset;
+    }
+
+    //--------------------------------------------------------------
+    void HttpCache::loadEncodings( Asset & asset ){
+        // precompressed siblings, unless they're older than the file
+        std::string gz = asset.path + ".gz";
+        std::string br = asset.path + ".br";
+        if ( lastWriteTime(gz) >= asset.mtime && readFile( gz, asset.gzip ) ){
+            ofLogVerbose("ofxLibwebsockets") << "Using " << gz;
+        }
+        if ( lastWriteTime(br) >= asset.mtime && readFile( br, asset.brotli ) ){
+            ofLogVerbose("ofxLibwebsockets") << "Using " << br;
+        }
+        
+        // no .gz: compress it ourselves, once
+        if ( asset.gzip.empty() && asset.body.size() >= minCompressSize && isCompressible(asset.mimetype) ){
+            gzipCompress( asset.body, asset.gzip );
+        }
+    }
+    
+    //--------------------------------------------------------------
+    bool HttpCache::acceptsEncoding( const std::string & acceptEncoding, const std::string & coding ){
+        // e.g. "gzip, deflate, br;q=0.9": listed, and not with q=0
+        size_t start = 0;
+        while ( start < acceptEncoding.size() ){
+            size_t end = acceptEncoding.find( ',', start );
+            if ( end == std::string::npos ) end = acceptEncoding.size();
+            std::string item = acceptEncoding.substr( start, end - start );
+            start = end + 1;
+            
+            size_t params = item.find( ';' );
+            std::string name = item.substr( 0, params );
+            name.erase( 0, name.find_first_not_of(" \t") );
+            name.erase( name.find_last_not_of(" \t") + 1 );
+            if ( name != coding && name != "*" ) continue;
+            
+            if ( params != std::string::npos ){
+                size_t q = item.find( "q=", params );
+                if ( q != std::string::npos && atof( item.c_str() + q + 2 ) <= 0 ) return false;
+            }
+            return true;
+        }
+        return false;
+    }
+    
+    //--------------------------------------------------------------
+    const std::unordered_map<std::string, std::string> & HttpCache::mimeTypes(){
+        static const std::unordered_map<std::string, std::string> types = {
+            { "html",     "text/html" },
+            { "htm",      "text/html" },
+            { "css",      "text/css" },
+            { "js",       "application/javascript" },
+            { "mjs",      "application/javascript" },
+            { "json",     "application/json" },
+            { "map",      "application/json" },
+            { "txt",      "text/plain" },
+            { "csv",      "text/csv" },
+            { "xml",      "application/xml" },
+            { "manifest", "text/cache-manifest" },
+            { "wasm",     "application/wasm" },
+            { "swf",      "application/x-shockwave-flash" },
+            { "ico",      "image/x-icon" },
+            { "png",      "image/png" },
+            { "jpg",      "image/jpeg" },
+            { "jpeg",     "image/jpeg" },
+            { "gif",      "image/gif" },
+            { "svg",      "image/svg+xml" },
+            { "webp",     "image/webp" },
+            { "mp3",      "audio/mpeg" },
+            { "wav",      "audio/wav" },
+            { "ogg",      "audio/ogg" },
+            { "mp4",      "video/mp4" },
+            { "webm",     "video/webm" },
+            { "m4v",      "video/mp4" },
+            { "mov",      "video/quicktime" },
+            { "mkv",      "video/x-matroska" },
+            { "woff",     "font/woff" },
+            { "woff2",    "font/woff2" },
+            { "ttf",      "font/ttf" },
+            { "otf",      "font/otf" },
+            { "gz",       "application/gzip" }
+        };
+        return types;
+    }
+    
+    //--------------------------------------------------------------
+    const std::string & HttpCache::mimeType( const std::string & ext ){
+        static const std::string fallback = "text/html";
+        
+        const std::unordered_map<std::string, std::string> & types = mimeTypes();
+        std::unordered_map<std::string, std::string>::const_iterator it = types.find( ofToLower(ext) );
+        return it != types.end() ? it->second : fallback;
+    }
+};
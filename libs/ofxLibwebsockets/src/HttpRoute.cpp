@@ -0,0 +1,82 @@
+//
+//  HttpRoute.cpp
+//  ofxLibwebsockets
+//
+
+#include "ofxLibwebsockets/HttpRoute.h"
+#include "ofxLibwebsockets/Reactor.h"
+
+namespace ofxLibwebsockets {
+
+    //--------------------------------------------------------------
+    static std::string lookup( const std::map<std::string, std::string> & values, const std::string & name ){
+        std::map<std::string, std::string>::const_iterator it = values.find( name );
+        return it != values.end() ? it->second : "";
+    }
+
+    //--------------------------------------------------------------
+    bool HttpRoute::matches( const std::string & url ) const {
+        if ( !path.empty() && path[path.size() - 1] == '*' ){
+            return url.compare( 0, path.size() - 1, path, 0, path.size() - 1 ) == 0;
+        }
+        return url == path;
+    }
+
+    //--------------------------------------------------------------
+    HttpRequest::HttpRequest()
+    : ws(NULL), spa(NULL), bTooLarge(false), bHeadersSent(false), offset(0)
+    , reactor(NULL), shard(0), tsi(0)
+    , bHandled(false), bResponded(false), bClosed(false), status(0){
+    }
+
+    //--------------------------------------------------------------
+    std::string HttpRequest::header( const std::string & name ) const {
+        return lookup( headers, name );
+    }
+
+    //--------------------------------------------------------------
+    std::string HttpRequest::arg( const std::string & name ) const {
+        return lookup( args, name );
+    }
+
+    //--------------------------------------------------------------
+    std::string HttpRequest::field( const std::string & name ) const {
+        return lookup( fields, name );
+    }
+
+    //--------------------------------------------------------------
+    void HttpRequest::addHeader( const std::string & name, const std::string & value ){
+        std::lock_guard<std::mutex> guard(mutex);
+        if ( !bResponded ){
+            responseHeaders.push_back( std::make_pair(name, value) );
+        }
+    }
+
+    //--------------------------------------------------------------
+    void HttpRequest::respond( int _status, const std::string & body, const std::string & _contentType ){
+        std::lock_guard<std::mutex> guard(mutex);
+        if ( bResponded || bClosed ) return;
+
+        status = _status;
+        responseBody = body;
+        contentType = _contentType;
+        bResponded = true;
+
+        // still in onRequest: the service thread picks it up when it returns
+        if ( bHandled ){
+            reactor->_httpRespond( shared_from_this() );
+        }
+    }
+
+    //--------------------------------------------------------------
+    bool HttpRequest::isResponded(){
+        std::lock_guard<std::mutex> guard(mutex);
+        return bResponded;
+    }
+
+    //--------------------------------------------------------------
+    bool HttpRequest::isOpen(){
+        std::lock_guard<std::mutex> guard(mutex);
+        return !bClosed;
+    }
+};
@@ -22,6 +22,13 @@ namespace ofxLibwebsockets {
         ofAddListener(onmessageEvent,      this, &Protocol::_onmessage);
         ofAddListener(onerrorEvent,         this, &Protocol::_onerror);
         rx_buffer_size = OFX_LWS_MAX_BUFFER;
+        tx_packet_size = 0;
+        max_fragment_size = OFX_LWS_MAX_FRAGMENT;
+        min_fragment_size = OFX_LWS_MIN_FRAGMENT;
+        max_message_size = OFX_LWS_MAX_MESSAGE;
+        bAdaptiveFragments = false;
+        bParseJSON = true;
+        bCopyPayload = true;
         idle = false;
     }
 
@@ -10,33 +10,139 @@
 
 namespace ofxLibwebsockets { 
 
-	vector<Reactor *> reactors = vector<Reactor *>();
-
     //--------------------------------------------------------------
     Reactor::Reactor()
-    : context(NULL), waitMillis(20){
-        //reactors.push_back(this);
+    : context(NULL), waitMillis(20), bEventDriven(false){
         bParseJSON = true;
-        largeMessage = "";
-        largeBinaryMessage.clear();
-        largeBinarySize     = 0;
-        bReceivingLargeMessage  = false;
         bAllowDuplicateConnections = true;
+        bMainThreadEvents = false;
+        bHttpCache = false;
+        highWatermark = 0;
+        lowWatermark = 0;
+        shards.push_back( std::unique_ptr<Shard>( new Shard(this, 0) ) );
     }
 
     //--------------------------------------------------------------
     Reactor::~Reactor(){
         //exit();
+        if ( bMainThreadEvents ){
+            ofRemoveListener( ofEvents().update, this, &Reactor::_onUpdate );
+        }
     }
 
     //--------------------------------------------------------------
     void Reactor::registerProtocol(const std::string& name, Protocol& protocol){
         protocol.idx = protocols.size();
-        protocol.rx_buffer_size = OFX_LWS_MAX_BUFFER;
         protocol.reactor = this;
         protocols.push_back(make_pair(name, &protocol));
     }
 
+    //--------------------------------------------------------------
+    void Reactor::setWatermarks( size_t high, size_t low ){
+        highWatermark = high;
+        lowWatermark = std::min( low, high );
+    }
+
+    //--------------------------------------------------------------
+    const struct lws_extension * Reactor::setupExtensions( const DeflateOptions & options ){
+        deflate = options;
+        if ( !deflate.bEnabled ) return NULL;
+        
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+        std::string windowBits = ofToString( std::max( 9, std::min(deflate.windowBits, 15) ) );
+        deflateOffer = "permessage-deflate; client_max_window_bits=" + windowBits +
+                       "; server_max_window_bits=" + windowBits;
+        if ( deflate.bNoContextTakeover ){
+            deflateOffer += "; client_no_context_takeover; server_no_context_takeover";
+        }
+        
+        memset(extensions, 0, sizeof extensions);
+        extensions[0].name = "permessage-deflate";
+        extensions[0].callback = lws_extension_callback_pm_deflate;
+        extensions[0].client_offer = deflateOffer.c_str();
+        return extensions;
+#else
+        ofLogWarning("ofxLibwebsockets") << "permessage-deflate is off: libwebsockets was built without extensions";
+        return NULL;
+#endif
+    }
+    
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+    //--------------------------------------------------------------
+    // window bits param of the first permessage-deflate offer / answer in a
+    // Sec-WebSocket-Extensions header; 15 (RFC 7692's default) if it's
+    // missing or has no value
+    static int deflateWindowBits( const std::string & header, const std::string & param ){
+        size_t start = header.find( "permessage-deflate" );
+        if ( start == std::string::npos ) return 15;
+        std::string offer = header.substr( start, header.find( ',', start ) - start );
+        
+        size_t pos = offer.find( param );
+        if ( pos == std::string::npos ) return 15;
+        pos = offer.find_first_not_of( ' ', pos + param.size() );
+        if ( pos == std::string::npos || offer[pos] != '=' ) return 15;
+        pos = offer.find_first_not_of( " \"", pos + 1 );
+        int bits = pos != std::string::npos ? atoi( offer.c_str() + pos ) : 0;
+        return bits >= 8 && bits <= 15 ? bits : 15;
+    }
+#endif
+    
+    //--------------------------------------------------------------
+    void Reactor::applyDeflateOptions( Connection * conn, bool bServer ){
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+        if ( !deflate.bEnabled ) return;
+        
+        // only our sending side can be tuned after the handshake: a smaller
+        // window and dropping the context between messages are always fine
+        // for the peer's decompressor, a window bigger than the one agreed
+        // on isn't. the server agreed to the client's offer (lws answers
+        // without window params), the client to the server's answer.
+        // these fail quietly if the peer didn't take the extension
+        const char * windowParam = bServer ? "server_max_window_bits" : "client_max_window_bits";
+        char header[256];
+        int n = lws_hdr_copy( conn->ws, header, sizeof header, WSI_TOKEN_EXTENSIONS );
+        if ( n > 0 ){
+            int windowBits = std::min( std::max( 9, std::min(deflate.windowBits, 15) ),
+                                       deflateWindowBits( std::string(header, n), windowParam ) );
+            lws_set_extension_option( conn->ws, "permessage-deflate", windowParam,
+                                      ofToString( windowBits ).c_str() );
+        }
+        if ( deflate.bNoContextTakeover ){
+            lws_set_extension_option( conn->ws, "permessage-deflate",
+                                      bServer ? "server_no_context_takeover" : "client_no_context_takeover", "1" );
+        }
+        lws_set_extension_option( conn->ws, "permessage-deflate", "mem_level",
+                                  ofToString( std::max( 1, std::min(deflate.memLevel, 9) ) ).c_str() );
+        lws_set_extension_option( conn->ws, "permessage-deflate", "compression_level",
+                                  ofToString( std::max( 1, std::min(deflate.compressionLevel, 9) ) ).c_str() );
+#endif
+    }
+
+    //--------------------------------------------------------------
+    struct lws_protocols Reactor::makeLwsProtocol( size_t i, lws_callback_function * callback, size_t perSessionSize ){
+        Protocol * protocol = protocols[i].second;
+        if ( protocol->max_fragment_size == 0 ){
+            protocol->max_fragment_size = protocol->rx_buffer_size;
+        }
+        
+        struct lws_protocols lws_protocol;
+        memset(&lws_protocol, 0, sizeof lws_protocol);
+        lws_protocol.name = ( protocols[i].first == "NULL" ? NULL : protocols[i].first.c_str() );
+        lws_protocol.callback = callback;
+        lws_protocol.per_session_data_size = perSessionSize;
+        lws_protocol.rx_buffer_size = protocol->rx_buffer_size;
+        lws_protocol.id = i;    // the callbacks find the Protocol by this
+        // left at 0, lws would cap each write at rx_buffer_size and
+        // buffer the rest of every fragment
+        lws_protocol.tx_packet_size = protocol->tx_packet_size != 0 ? protocol->tx_packet_size : protocol->max_fragment_size;
+        return lws_protocol;
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::setSlowConsumerPolicy( const SlowConsumerPolicy & policy ){
+        slowConsumer = policy;
+    }
+
     //--------------------------------------------------------------
     Protocol* const Reactor::protocol(const unsigned int idx){
         return (idx < protocols.size())? protocols[idx].second : NULL;
@@ -47,6 +153,156 @@ namespace ofxLibwebsockets {
         waitMillis = millis;
     }
 
+    //--------------------------------------------------------------
+    void Reactor::wake( int shard ){
+        // lws_cancel_service is safe to call from any thread; it makes the
+        // service threads return from their poll wait with EVENT_WAIT_CANCELLED
+        if ( bEventDriven && shards[shard]->context != NULL ){
+            lws_cancel_service(shards[shard]->context);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::wake( int shard, int tsi ){
+        // _servicePending clears it before it looks at the queues
+        if ( !shards[shard]->serviceStates[tsi].wakePending.exchange(true) ){
+            wake( shard );
+        }
+    }
+
+    //--------------------------------------------------------------
+    struct lws_context * Reactor::createContext( struct lws_context_creation_info & info, int shard ){
+        while ( (int)shards.size() <= shard ){
+            shards.push_back( std::unique_ptr<Shard>( new Shard(this, shards.size()) ) );
+        }
+        info.user = shards[shard].get();
+        shards[shard]->context = lws_create_context(&info);
+        if ( shard == 0 ){
+            context = shards[0]->context;
+        }
+        return shards[shard]->context;
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::destroyContexts(){
+        for (size_t i=0; i<shards.size(); i++){
+            if ( shards[i]->context != NULL ){
+                lws_context_destroy( shards[i]->context );
+                shards[i]->context = NULL;
+            }
+        }
+        context = NULL;
+    }
+
+    //--------------------------------------------------------------
+    Reactor * Reactor::_reactorFor( struct lws *ws ){
+        Shard * shard = ws == NULL ? NULL : (Shard *) lws_context_user( lws_get_context(ws) );
+        return shard == NULL ? NULL : shard->reactor;
+    }
+
+    //--------------------------------------------------------------
+    int Reactor::_shardIndex( struct lws *ws ){
+        Shard * shard = ws == NULL ? NULL : (Shard *) lws_context_user( lws_get_context(ws) );
+        return shard == NULL ? 0 : shard->index;
+    }
+
+    //--------------------------------------------------------------
+    unsigned char * Reactor::_sendBuffer( size_t size, int shard, int tsi ){
+        std::vector<unsigned char> & sendBuffer = shards[shard]->serviceStates[tsi].sendBuffer;
+        size_t needed = LWS_SEND_BUFFER_PRE_PADDING + size + LWS_SEND_BUFFER_POST_PADDING;
+        if ( sendBuffer.size() < needed ){
+            sendBuffer.resize( needed );
+        }
+        return &sendBuffer[0];
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_schedule( Connection * conn ){
+        // not established yet: it gets a writable callback when it is
+        if ( conn->getId() == OFX_LWS_INVALID_CONNECTION ) return;
+        
+        if ( !conn->bScheduled.exchange(true) ){
+            shards[conn->shard]->serviceStates[conn->tsi].pendingOutput.push( conn->getId() );
+            wake( conn->shard, conn->tsi );
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_resumeRx( Connection * conn ){
+        // rx flow control belongs to the service thread: hand it over
+        shards[conn->shard]->serviceStates[conn->tsi].resumeRx.push( conn->getId() );
+        wake( conn->shard, conn->tsi );
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_servicePending( int shard, int tsi ){
+        // ids, not pointers, so a connection that closed in the
+        // meantime simply isn't found. the lookup is locked because other
+        // service threads may be adding / removing connections; the
+        // connection itself can only be destroyed on this thread
+        ServiceState & state = shards[shard]->serviceStates[tsi];
+        
+        // anything queued from now on needs a new wakeup
+        state.wakePending = false;
+        
+        // answers to HTTP requests from other threads
+        HttpRequestPtr request;
+        while ( state.httpResponses.pop(request) ){
+            if ( request->ws != NULL ){
+                lws_callback_on_writable(request->ws);
+            }
+            request.reset();
+        }
+        
+        // take both queues, then resolve the whole batch with one lock
+        // rather than one per id: Server::send() holds it while it walks
+        // every connection
+        state.ids.clear();
+        ConnectionId id;
+        while ( state.resumeRx.pop(id) ) state.ids.push_back(id);
+        state.resumeCount = state.ids.size();
+        while ( state.pendingOutput.pop(id) ) state.ids.push_back(id);
+        if ( state.ids.empty() ) return;
+        
+        state.batch.resize( state.ids.size() );
+        lock();
+        for (size_t i=0; i<state.ids.size(); i++){
+            state.batch[i] = connections.get( state.ids[i] );
+        }
+        unlock();
+        
+        for (size_t i=0; i<state.resumeCount; i++){
+            Connection * conn = state.batch[i];
+            if ( conn == NULL || conn->ws == NULL ) continue;
+            
+            // messages that didn't fit go first; still no room: stay paused
+            while ( !conn->heldMessages.empty() &&
+                    dispatcher.push( conn, std::move(conn->heldMessages.front().first), conn->heldMessages.front().second ) ){
+                conn->heldMessages.pop_front();
+            }
+            if ( conn->heldMessages.empty() ){
+                lws_rx_flow_control(conn->ws, 1);
+            }
+        }
+        
+        for (size_t i=state.resumeCount; i<state.batch.size(); i++){
+            Connection * conn = state.batch[i];
+            if ( conn == NULL || conn->ws == NULL ) continue;
+            
+            conn->bScheduled = false;
+            if ( bEventDriven ){
+                // move sends into the queue now rather than on the writable
+                // callback, so conflation applies while the socket is choked
+                conn->drainOutbox();
+                conn->checkWatermarks();
+                conn->checkSlowConsumer();
+                lws_callback_on_writable(conn->ws);
+            } else {
+                conn->update();
+            }
+        }
+    }
+
     //--------------------------------------------------------------
 //    void Reactor::exit(){
 //        if (context != NULL)
@@ -72,17 +328,64 @@ namespace ofxLibwebsockets {
         return context;
     }
     
+    //--------------------------------------------------------------
+    int Reactor::getNumShards(){
+        return shards.size();
+    }
+    
     //--------------------------------------------------------------
     vector<Connection *> Reactor::getConnections(){
-        return connections;
+        lock();
+        vector<Connection *> ret = connections.asVector();
+        unlock();
+        return ret;
     }
     
     //--------------------------------------------------------------
     Connection * Reactor::getConnection( int index ){
+        Connection * ret = NULL;
+        lock();
         if ( index < connections.size() ){
-            return connections[ index ];
+            ret = connections[ index ];
         }
-        return NULL;
+        unlock();
+        return ret;
+    }
+    
+    //--------------------------------------------------------------
+    Connection * Reactor::getConnectionById( ConnectionId id ){
+        lock();
+        Connection * ret = connections.get(id);
+        unlock();
+        return ret;
+    }
+
+    //--------------------------------------------------------------
+    bool Reactor::sendTo( ConnectionId id, const std::string & message, unsigned int key ){
+        lock();
+        Connection * conn = connections.get(id);
+        if ( conn != NULL ){
+            conn->sendConflated( message, key );
+        }
+        unlock();
+        return conn != NULL;
+    }
+    
+    //--------------------------------------------------------------
+    bool Reactor::sendBinaryTo( ConnectionId id, const char * data, unsigned int size, unsigned int key ){
+        if ( size == 0 ) return false;
+        return sendBinaryTo( id, Connection::makePayload(data, size), size, key );
+    }
+    
+    //--------------------------------------------------------------
+    bool Reactor::sendBinaryTo( ConnectionId id, const SharedPayload & data, unsigned int size, unsigned int key ){
+        lock();
+        Connection * conn = connections.get(id);
+        if ( conn != NULL ){
+            conn->sendBinaryConflated( data, size, key );
+        }
+        unlock();
+        return conn != NULL;
     }
 
     //--------------------------------------------------------------
@@ -113,6 +416,13 @@ namespace ofxLibwebsockets {
             return 1;
         }
         
+        if ( reason == LWS_CALLBACK_ESTABLISHED || reason == LWS_CALLBACK_CLIENT_ESTABLISHED ){
+            // sends are queued for the service thread that owns the socket
+            conn->shard = _shardIndex(conn->ws);
+            conn->tsi = lws_get_tsi(conn->ws);
+            applyDeflateOptions( conn, reason == LWS_CALLBACK_ESTABLISHED );
+        }
+        
         std::string message;
         Event args(*conn, message);
         
@@ -121,153 +431,144 @@ namespace ofxLibwebsockets {
             case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
                 ofLogError()<<"[ofxLibwebsockets] Connection error";
                 
-                for (size_t i=0; i<connections.size(); i++){
-                    if ( connections[i] == conn ){
-                        connections.erase( connections.begin() + i );
-                        break;
-                    }
-                }
-                ofNotifyEvent(conn->protocol->oncloseEvent, args);
+                lock();
+                connections.remove( conn );
+                unlock();
+                if ( !_closeInbox( conn ) ) _deliver(QueuedEvent::CLOSE, conn, args);
                 break;
                 
             // last thing that happens before connection goes dark
             case LWS_CALLBACK_WSI_DESTROY:
             {
-                bool bFound = false;
-                for (size_t i=0; i<connections.size(); i++){
-                    if ( connections[i] == conn ){
-                        bFound = true; // valid connection
-                        connections.erase( connections.begin() + i );
-                        break;
-                    }
-                }
+                lock();
+                bool bFound = connections.remove( conn ); // valid connection?
+                unlock();
                 
-                if ( bFound ) ofNotifyEvent(conn->protocol->oncloseEvent, args);
+                if ( bFound && !_closeInbox( conn ) ) _deliver(QueuedEvent::CLOSE, conn, args);
             }
                 break;
             
             case LWS_CALLBACK_CLIENT_ESTABLISHED:   // client connected with server
-                connections.push_back( conn );
-                ofNotifyEvent(conn->protocol->onconnectEvent, args);
+                lock();
+                connections.add( conn );
+                unlock();
+                _deliver(QueuedEvent::CONNECT, conn, args);
                 break;
             case LWS_CALLBACK_ESTABLISHED:          // server connected with client
-                if(bAllowDuplicateConnections) {
-                    connections.push_back( conn );
-                    ofNotifyEvent(conn->protocol->onconnectEvent, args);
-                }  else {
-                    for (size_t i=0; i<connections.size(); i++){
-                        if ( strcmp(connections[i]->getClientIP().c_str(),conn->getClientIP().c_str()) == 0)
-                        {
-                            //close the connection
-                            return 1;
-                        }
-                    }
-                    connections.push_back( conn );
-                    ofNotifyEvent(conn->protocol->onconnectEvent, args);
+                lock();
+                if( !bAllowDuplicateConnections && connections.hasIP( conn->getClientIP() ) ) {
+                    //close the connection
+                    unlock();
+                    return 1;
                 }
+                connections.add( conn );
+                unlock();
+                _deliver(QueuedEvent::CONNECT, conn, args);
                 break;
                 
             case LWS_CALLBACK_CLOSED:
                 // erase connection from vector
-                for (size_t i=0; i<connections.size(); i++){
-                    if ( connections[i] == conn ){
-                        ofLogNotice() << "Deleting connection";
-                        connections.erase( connections.begin() + i );
-                        break;
-                    }
+                lock();
+                if ( connections.remove( conn ) ){
+                    ofLogNotice() << "Deleting connection";
                 }
+                unlock();
                 
-                ofNotifyEvent(conn->protocol->oncloseEvent, args);
+                if ( !_closeInbox( conn ) ) _deliver(QueuedEvent::CLOSE, conn, args);
                 break;
                 
             case LWS_CALLBACK_SERVER_WRITEABLE:
             case LWS_CALLBACK_CLIENT_WRITEABLE:
                 // idle is good! means you can write again
                 conn->setIdle();
+                // write straight away; in event driven mode nothing else will
+                conn->update();
+                break;
+                
+            // slow consumer grace period is up (see Connection::checkSlowConsumer)
+            case LWS_CALLBACK_TIMER:
+                if ( conn->checkSlowConsumer(true) ) return 1;
                 break;
                 
             case LWS_CALLBACK_RECEIVE:              // server receive
             case LWS_CALLBACK_CLIENT_RECEIVE:       // client receive
             case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
                 {
-                    
-                    bool bFinishedReceiving = false;
-                    
                     // decide if this is part of a larger message or not
                     size_t bytesLeft = lws_remaining_packet_payload( conn->ws );
-                    
-                    if ( !bReceivingLargeMessage && (bytesLeft > 0 || !lws_is_final_fragment( conn->ws )) ){
-                        bReceivingLargeMessage = true;
-                    }
+                    bool bFinal = bytesLeft == 0 && lws_is_final_fragment( conn->ws );
                     
                     // text or binary?
-                    int isBinary = lws_frame_is_binary(conn->ws);
+                    args.isBinary = lws_frame_is_binary(conn->ws) == 1;
                     
-                    if (isBinary == 1 ){
-                        // set binary flag on event
-                        args.isBinary = true;
-                        
-                        if ( bReceivingLargeMessage){
-                            // need to allocate data...
-                            if ( largeBinarySize == 0 ){
-                                largeBinaryMessage.set( _message, len );
-                                largeBinarySize = len;
-                            } else {
-                                largeBinarySize += len;
-                                largeBinaryMessage.append(_message, len);
-                            }
-                            
-                            if ( bytesLeft == 0 && lws_is_final_fragment( conn->ws )){
-                                // copy into event
-                                args.data.set(largeBinaryMessage.getData(), largeBinaryMessage.size());
-                                
-                                bFinishedReceiving      = true;
-                                bReceivingLargeMessage  = false;
-                                largeBinaryMessage.clear();
-                                largeBinarySize = 0;
-                            }
-                        } else {
-                            args.data.set(_message, len);
-                            
-                            bFinishedReceiving      = true;
-                            bReceivingLargeMessage  = false;
-                            largeBinaryMessage.clear();
-                            largeBinarySize = 0;
+                    if ( !conn->bReceivingLargeMessage && bFinal && len <= conn->protocol->max_message_size ){
+                        // the whole message arrived at once: point
+                        // straight at lws' rx buffer
+                        if ( _message != NULL ){
+                            args.payload = std::string_view(_message, len);
                         }
                     } else {
-                        if (_message != NULL && len > 0){
-                            args.message = std::string(_message, len);
+                        // reassemble on the connection, so fragments from
+                        // different clients can't get mixed up
+                        if ( !conn->appendFragment( _message, len, bytesLeft ) ){
+                            ofLogWarning("ofxLibwebsockets") << "Message from " << conn->getClientIP()
+                                << " is over max_message_size (" << conn->protocol->max_message_size << " bytes), closing";
+                            lws_close_reason( conn->ws, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE, NULL, 0 );
+                            return 1;
                         }
                         
-                        if ( bReceivingLargeMessage){
-                            largeMessage += args.message;
-                            if ( bytesLeft == 0 && lws_is_final_fragment( conn->ws )){
-                                args.message = largeMessage;
-                                bFinishedReceiving      = true;
-                                bReceivingLargeMessage  = false;
-                                largeMessage = "";
-                            }
-                        }
+                        // only notify if we have a complete message
+                        if ( !bFinal ) break;
                         
-                        if (_message != NULL && len > 0 && (!bReceivingLargeMessage || bFinishedReceiving) ){
-                            
-                            if ( bParseJSON ){
-                                try {
-                                    args.json = ofJson::parse( args.message );
-                                }
-                                catch( std::exception& e ){
-                                    // report to the user the failure
-                                    args.json.clear();
-                                    ofLogVerbose() << "[ofxLibwebsockets] Failed to parse JSON: " <<  e.what();
-                                }
-                            }
-                            
+                        args.payload = std::string_view(conn->largeMessage);
+                        args.payloadOwner = &conn->largeMessage;
+                        conn->bReceivingLargeMessage = false;
+                    }
+                    
+                    if ( bMainThreadEvents || dispatcher.isRunning() ){
+                        // hand the message to the main thread or a worker; it
+                        // outlives the lws buffer, so single reads are copied once here
+                        std::string owned;
+                        if ( args.payloadOwner != NULL ){
+                            owned.swap( *args.payloadOwner );
+                        } else {
+                            owned.assign( args.payload.data(), args.payload.size() );
+                        }
+                        if ( bMainThreadEvents ){
+                            _queueEvent( QueuedEvent::MESSAGE, conn, std::move(owned), args.isBinary );
+                        } else if ( !conn->heldMessages.empty() ||
+                                    !dispatcher.push( conn, std::move(owned), args.isBinary ) ){
+                            // workers are behind: keep it here and stop
+                            // reading from this client until there's room
+                            conn->heldMessages.push_back( std::make_pair(std::string(), args.isBinary) );
+                            conn->heldMessages.back().first.swap( owned );
+                            lws_rx_flow_control( conn->ws, 0 );
+                        }
+                        break;
+                    }
+                    
+                    if ( conn->protocol->bCopyPayload ){
+                        if ( args.isBinary ){
+                            args.data.set(args.payload.data(), args.payload.size());
+                        } else if ( args.payloadOwner != NULL ){
+                            // hand the reassembled text over without copying
+                            args.message.swap( *args.payloadOwner );
+                            args.payloadOwner = &args.message;
+                            args.payload = std::string_view(args.message);
+                        } else {
+                            args.message.assign(args.payload.data(), args.payload.size());
                         }
                     }
                     
-                    // only notify if we have a complete message
-                    if (!bReceivingLargeMessage || bFinishedReceiving){
-                        ofNotifyEvent(conn->protocol->onmessageEvent, args);
+                    if ( bParseJSON && conn->protocol->bParseJSON ){
+                        args.parseJson();
+                    }
+                    
+                    ofNotifyEvent(conn->protocol->onmessageEvent, args);
+                    
+                    // free the reassembly buffer unless a handler took it
+                    if ( conn->largeMessage.capacity() > 0 ){
+                        std::string().swap(conn->largeMessage);
                     }
                 }
                 break;
@@ -287,37 +588,640 @@ namespace ofxLibwebsockets {
     }
 
     //--------------------------------------------------------------
-    unsigned int Reactor::_http(struct lws *ws,
-                              const char* const _url){
+    void Reactor::_setPayload( Event & args, std::string & payload ){
+        args.payloadOwner = &payload;
+        
+        if ( args.conn.protocol->bCopyPayload ){
+            if ( args.isBinary ){
+                args.data.set(payload.data(), payload.size());
+            } else {
+                args.message.swap( payload );
+                args.payloadOwner = &args.message;
+            }
+        }
+        args.payload = std::string_view(*args.payloadOwner);
+        if ( bParseJSON && args.conn.protocol->bParseJSON ){
+            args.parseJson();
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_dispatch( Connection * conn, std::string & payload, bool isBinary ){
+        Event args(*conn, "", isBinary);
+        _setPayload( args, payload );
+        ofNotifyEvent(conn->protocol->onmessageEvent, args);
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_dispatchClose( Connection * conn ){
+        Event args(*conn, "");
+        ofNotifyEvent(conn->protocol->oncloseEvent, args);
+    }
+
+    //--------------------------------------------------------------
+    bool Reactor::_closeInbox( Connection * conn ){
+        // held messages are delivered too, the queue limit aside
+        while ( !conn->heldMessages.empty() ){
+            dispatcher.push( conn, std::move(conn->heldMessages.front().first), conn->heldMessages.front().second, true );
+            conn->heldMessages.pop_front();
+        }
+        return dispatcher.close( conn );
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_openSession( ConnectionSession * session, Protocol * protocol ){
+        if ( bMainThreadEvents || dispatcher.isRunning() ){
+            // events for it are delivered later on the main thread or a
+            // worker, so it must outlive the session; drainEvents() or the
+            // dispatcher deletes it
+            session->conn = new Connection(this, protocol);
+        } else {
+            session->conn = new (&session->storage) Connection(this, protocol);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_closeSession( ConnectionSession * session ){
+        Connection * conn = session->conn;
+        session->conn = NULL;
+        
+        if ( conn == (Connection *) &session->storage ){
+            conn->~Connection();
+        } else {
+            conn->bClosed = true;   // stop accepting sends before ws goes away
+            conn->ws = NULL;        // lws is done with it
+            if ( dispatcher.release( conn ) ){
+                // a worker deletes it after its last message
+            } else if ( bMainThreadEvents ){
+                _queueEvent( QueuedEvent::RELEASE, conn );
+            } else {
+                delete conn;
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_deliver( QueuedEvent::Type type, Connection * conn, Event & args ){
+        if ( bMainThreadEvents ){
+            _queueEvent( type, conn );
+            return;
+        }
+        switch ( type ){
+            case QueuedEvent::CONNECT:  ofNotifyEvent(conn->protocol->onconnectEvent, args); break;
+            case QueuedEvent::CLOSE:    ofNotifyEvent(conn->protocol->oncloseEvent, args); break;
+            case QueuedEvent::IDLE:     ofNotifyEvent(conn->protocol->onidleEvent, args); break;
+            case QueuedEvent::BACKPRESSURE: ofNotifyEvent(conn->protocol->onbackpressureEvent, args); break;
+            case QueuedEvent::DRAIN:    ofNotifyEvent(conn->protocol->ondrainEvent, args); break;
+            default: break;
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_queueEvent( QueuedEvent::Type type, Connection * conn, std::string && payload, bool isBinary ){
+        QueuedEvent ev;
+        ev.type = type;
+        ev.conn = conn;
+        ev.payload.swap( payload );
+        ev.isBinary = isBinary;
+        queuedEvents.push( std::move(ev) );
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::setMainThreadEvents( bool bMainThread ){
+        if ( bMainThread == bMainThreadEvents ) return;
+        bMainThreadEvents = bMainThread;
+        if ( bMainThreadEvents ){
+            ofAddListener( ofEvents().update, this, &Reactor::_onUpdate );
+        } else {
+            ofRemoveListener( ofEvents().update, this, &Reactor::_onUpdate );
+            drainEvents();
+        }
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_onUpdate( ofEventArgs & args ){
+        drainEvents();
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::drainEvents(){
+        // grab everything queued so far, then deliver in order. runs of
+        // messages for one protocol go out together, as one onMessageBatch
+        // if anybody listens for that
+        QueuedEvent ev;
+        while ( queuedEvents.pop(ev) ){
+            drainBuffer.push_back( std::move(ev) );
+        }
+        
+        size_t i = 0;
+        while ( i < drainBuffer.size() ){
+            QueuedEvent & e = drainBuffer[i];
+            
+            if ( e.type == QueuedEvent::MESSAGE ){
+                size_t end = i + 1;
+                while ( end < drainBuffer.size() && drainBuffer[end].type == QueuedEvent::MESSAGE
+                        && drainBuffer[end].conn->protocol == e.conn->protocol ){
+                    end++;
+                }
+                _deliverMessages( &drainBuffer[i], end - i );
+                i = end;
+                continue;
+            }
+            
+            Event args(*e.conn, "");
+            switch ( e.type ){
+                case QueuedEvent::CONNECT:
+                    ofNotifyEvent(e.conn->protocol->onconnectEvent, args);
+                    break;
+                case QueuedEvent::CLOSE:
+                    ofNotifyEvent(e.conn->protocol->oncloseEvent, args);
+                    break;
+                case QueuedEvent::IDLE:
+                    e.conn->bIdleQueued = false;
+                    ofNotifyEvent(e.conn->protocol->onidleEvent, args);
+                    break;
+                case QueuedEvent::BACKPRESSURE:
+                    ofNotifyEvent(e.conn->protocol->onbackpressureEvent, args);
+                    break;
+                case QueuedEvent::DRAIN:
+                    ofNotifyEvent(e.conn->protocol->ondrainEvent, args);
+                    break;
+                case QueuedEvent::RELEASE:
+                    // always the last event queued for conn
+                    delete e.conn;
+                    break;
+                default:
+                    break;
+            }
+            i++;
+        }
+        drainBuffer.clear();
+    }
+
+    //--------------------------------------------------------------
+    void Reactor::_deliverMessages( QueuedEvent * events, size_t count ){
+        Protocol * protocol = events[0].conn->protocol;
+        
+        if ( protocol->onmessagebatchEvent.size() > 0 ){
+            // reserved up front: the events point into themselves, they
+            // must not move once their payload is set
+            messageBatch.reserve( count );
+            for (size_t i=0; i<count; i++){
+                messageBatch.emplace_back( *events[i].conn, "", events[i].isBinary );
+            }
+            for (size_t i=0; i<count; i++){
+                _setPayload( messageBatch[i], events[i].payload );
+            }
+            ofNotifyEvent(protocol->onmessagebatchEvent, messageBatch);
+            messageBatch.clear();
+        } else {
+            for (size_t i=0; i<count; i++){
+                Event args(*events[i].conn, "", events[i].isBinary);
+                _setPayload( args, events[i].payload );
+                ofNotifyEvent(protocol->onmessageEvent, args);
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    int Reactor::_http(struct lws *ws,
+                              const char* const _url,
+                              ConnectionSession * session){
+        // dynamic routes first, then files
+        int result = 0;
+        if ( session != NULL && !routes.empty() && _httpRoute(ws, _url, session, result) ){
+            return result;
+        }
+        
         std::string url(_url);
         if (url == "/")
             url = "/index.html";
         
-        // why does this need to be done?
-        std::string ext = url.substr(url.find_last_of(".")+1);
         // watch out for query strings!
         size_t find = url.find("?");
         if ( find!=string::npos ){
             url = url.substr(0,url.find("?"));
         }
-        std::string file = document_root+url;
-        std::string mimetype = "text/html";
         
-        if (ext == "ico")
-            mimetype = "image/x-icon";
-        if (ext == "manifest")
-            mimetype = "text/cache-manifest";
-        if (ext == "swf")
-            mimetype = "application/x-shockwave-flash";
-        if (ext == "js")
-            mimetype = "application/javascript";
-        if (ext == "css")
-            mimetype = "text/css";
+        std::string file = httpCache.pathFor(url);
+        if ( file.empty() ){
+            lws_return_http_status(ws, HTTP_STATUS_FORBIDDEN, NULL);
+            return lws_http_transaction_completed(ws) ? -1 : 0;
+        }
+        
+        HttpCache::AssetPtr asset;
+        if ( bHttpCache && session != NULL ){
+            asset = httpCache.get(url);
+        }
         
-        if (lws_serve_http_file(ws, file.c_str(), mimetype.c_str(), "", 0) < 0){
-            ofLog( OF_LOG_WARNING, "[ofxLibwebsockets] Failed to send HTTP file "+ file + " for "+ url);
+        if ( !asset ){
+            // not cached (too big, missing or caching is off): lws
+            // streams it from disk, or answers 404
+            size_t dot = url.find_last_of(".");
+            std::string ext = dot == string::npos ? "" : url.substr(dot+1);
+            int n = lws_serve_http_file(ws, file.c_str(), HttpCache::mimeType(ext).c_str(), NULL, 0);
+            if ( n < 0 ){
+                ofLog( OF_LOG_WARNING, "[ofxLibwebsockets] Failed to send HTTP file "+ file + " for "+ url);
+                return -1;
+            }
+            // > 0: done already, keep the connection for the next request
+            return ( n > 0 && lws_http_transaction_completed(ws) ) ? -1 : 0;
         }
         
-        return 1; // 1 will close the HTTP connection when done
+        // smallest encoding the client takes; each one has its own ETag
+        const std::string * body = &asset->body;
+        const char * encoding = NULL;
+        std::string etag = asset->etag;
+        if ( !asset->gzip.empty() || !asset->brotli.empty() ){
+            std::string accept = _httpHeader(ws, WSI_TOKEN_HTTP_ACCEPT_ENCODING);
+            if ( !asset->brotli.empty() && HttpCache::acceptsEncoding(accept, "br") ){
+                body = &asset->brotli;
+                encoding = "br";
+            } else if ( !asset->gzip.empty() && HttpCache::acceptsEncoding(accept, "gzip") ){
+                body = &asset->gzip;
+                encoding = "gzip";
+            }
+            if ( encoding != NULL ){
+                etag.insert( etag.size() - 1, std::string("-") + encoding );
+            }
+        }
+        
+        // the browser already has this version
+        std::string etags = _httpHeader(ws, WSI_TOKEN_HTTP_IF_NONE_MATCH);
+        bool bNotModified = etags.find(etag) != string::npos || etags == "*";
+        
+        unsigned char headers[LWS_PRE + 512];
+        unsigned char * start = &headers[LWS_PRE];
+        unsigned char * p = start;
+        unsigned char * end = &headers[sizeof(headers) - 1];
+        
+        if ( lws_add_http_common_headers(ws, bNotModified ? HTTP_STATUS_NOT_MODIFIED : HTTP_STATUS_OK,
+                                         asset->mimetype.c_str(), bNotModified ? 0 : body->size(), &p, end) ||
+             lws_add_http_header_by_token(ws, WSI_TOKEN_HTTP_ETAG,
+                                          (const unsigned char *) etag.c_str(), (int) etag.size(), &p, end) ||
+             lws_add_http_header_by_token(ws, WSI_TOKEN_HTTP_CACHE_CONTROL,
+                                          (const unsigned char *) "no-cache", 8, &p, end) ||
+             ( encoding != NULL && lws_add_http_header_by_token(ws, WSI_TOKEN_HTTP_CONTENT_ENCODING,
+                                          (const unsigned char *) encoding, (int) strlen(encoding), &p, end) ) ||
+             ( ( !asset->gzip.empty() || !asset->brotli.empty() ) && lws_add_http_header_by_token(ws, WSI_TOKEN_HTTP_VARY,
+                                          (const unsigned char *) "Accept-Encoding", 15, &p, end) ) ||
+             lws_finalize_write_http_header(ws, start, &p, end) ){
+            return -1;
+        }
+        
+        if ( bNotModified || body->empty() ){
+            return lws_http_transaction_completed(ws) ? -1 : 0;
+        }
+        
+        // the body goes out on HTTP_WRITEABLE, a chunk at a time
+        _httpClosed(session);
+        session->http = new HttpResponse();
+        session->http->asset = asset;
+        session->http->body = body;
+        session->http->offset = 0;
+        lws_callback_on_writable(ws);
+        return 0;
+    }
+    
+    //--------------------------------------------------------------
+    int Reactor::_httpWritable(struct lws *ws, ConnectionSession * session){
+        if ( session != NULL && session->request != NULL ){
+            return httpRouteWritable(ws, session);
+        }
+        if ( session == NULL || session->http == NULL ) return 0;
+        
+        HttpResponse & response = *session->http;
+        int n = httpWriteBody(ws, *response.body, response.offset);
+        if ( n <= 0 ) return n;
+        
+        _httpClosed(session);
+        // keep alive: the connection waits for the next request
+        return lws_http_transaction_completed(ws) ? -1 : 0;
+    }
+    
+    //--------------------------------------------------------------
+    int Reactor::httpWriteBody( struct lws *ws, const std::string & body, size_t & offset ){
+        size_t size = std::min( body.size() - offset, (size_t) OFX_LWS_MAX_FRAGMENT );
+        bool bDone = offset + size >= body.size();
+        
+        // lws_write needs LWS_PRE writable bytes in front of the data
+        unsigned char * buf = _sendBuffer( size, _shardIndex(ws), lws_get_tsi(ws) );
+        memcpy( &buf[LWS_PRE], body.data() + offset, size );
+        if ( lws_write(ws, &buf[LWS_PRE], size, bDone ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < (int) size ){
+            return -1;
+        }
+        offset += size;
+        
+        if ( !bDone ){
+            lws_callback_on_writable(ws);
+            return 0;
+        }
+        return 1;
+    }
+    
+    //--------------------------------------------------------------
+    std::string Reactor::_httpHeader(struct lws *ws, enum lws_token_indexes token){
+        int len = lws_hdr_total_length(ws, token);
+        if ( len <= 0 ) return "";
+        std::string value(len + 1, '\0');
+        if ( lws_hdr_copy(ws, &value[0], len + 1, token) < 0 ) return "";
+        value.resize(len);
+        return value;
+    }
+    
+    //--------------------------------------------------------------
+    void Reactor::_httpClosed(ConnectionSession * session){
+        if ( session != NULL && session->http != NULL ){
+            delete session->http;
+            session->http = NULL;
+        }
+        httpRelease(session);
+    }
+    
+    //--------------------------------------------------------------
+    // room lws-spa gets for decoded form field values, per request
+    static const int formStorage = 16 * 1024;
+    
+    //--------------------------------------------------------------
+    static std::string httpMethod( struct lws *ws ){
+        static const char * methods[] = { "GET", "POST", "OPTIONS", "PUT", "PATCH", "DELETE", "CONNECT", "HEAD" };
+        
+        char * uri = NULL;
+        int len = 0;
+        int method = lws_http_get_uri_and_method(ws, &uri, &len);
+        if ( method >= 0 && method < (int)(sizeof(methods) / sizeof(methods[0])) ){
+            return methods[method];
+        }
+#if defined(LWS_ROLE_H2)
+        // http/2 sends it as a pseudo header
+        if ( method == LWSHUMETH_COLON_PATH ){
+            int n = lws_hdr_total_length(ws, WSI_TOKEN_HTTP_COLON_METHOD);
+            std::string value(n + 1, '\0');
+            if ( n > 0 && lws_hdr_copy(ws, &value[0], n + 1, WSI_TOKEN_HTTP_COLON_METHOD) >= 0 ){
+                value.resize(n);
+                return value;
+            }
+        }
+#endif
+        return "";
+    }
+    
+    //--------------------------------------------------------------
+    static bool isForm( const std::string & contentType ){
+        return contentType.compare(0, 33, "application/x-www-form-urlencoded") == 0 ||
+               contentType.compare(0, 19, "multipart/form-data") == 0;
+    }
+    
+    //--------------------------------------------------------------
+    bool Reactor::_httpRoute(struct lws *ws, const std::string & url, ConnectionSession * session, int & result){
+        std::string method = httpMethod(ws);
+        const HttpRoute * route = NULL;
+        bool bPathFound = false;
+        for (size_t i=0; i<routes.size() && route == NULL; i++){
+            if ( routes[i].matches(url) ){
+                bPathFound = true;
+                if ( routes[i].method == method ) route = &routes[i];
+            }
+        }
+        if ( !bPathFound ) return false;
+        
+        if ( route == NULL ){
+            lws_return_http_status(ws, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL);
+            result = lws_http_transaction_completed(ws) ? -1 : 0;
+            return true;
+        }
+        
+        // the lws session keeps the request until the response is out or
+        // the connection closes, whichever comes first
+        _httpClosed(session);
+        HttpRequestPtr request( new HttpRequest() );
+        request->self = request;
+        request->route = *route;
+        request->method = method;
+        request->path = url;
+        request->ws = ws;
+        request->reactor = this;
+        request->shard = _shardIndex(ws);
+        request->tsi = lws_get_tsi(ws);
+        session->request = request.get();
+        
+        // copy what we need now: lws only keeps the headers for this request
+        for (int token=0; token<WSI_TOKEN_COUNT; token++){
+            const char * name = (const char *) lws_token_to_string( (enum lws_token_indexes) token );
+            size_t len = name == NULL ? 0 : strlen(name);
+            // skip "get " style uri tokens and http/2 pseudo headers
+            if ( len < 2 || name[0] == ':' || name[len - 1] != ':' ) continue;
+            
+            std::string value = _httpHeader(ws, (enum lws_token_indexes) token);
+            if ( !value.empty() ){
+                request->headers[ std::string(name, len - 1) ] = value;
+            }
+        }
+        
+        // urldecoded "name=value" fragments
+        char arg[1024];
+        for (int i=0; lws_hdr_copy_fragment(ws, arg, sizeof arg, WSI_TOKEN_HTTP_URI_ARGS, i) >= 0; i++){
+            char * eq = strchr(arg, '=');
+            if ( eq != NULL ){
+                *eq = '\0';
+                request->args[arg] = eq + 1;
+            } else {
+                request->args[arg] = "";
+            }
+        }
+        
+        char ip[128];
+        request->clientIP = lws_get_peer_simple(ws, ip, sizeof ip) != NULL ? ip : "";
+        
+        result = 0;
+        bool bHasBody = atoll( request->header("content-length").c_str() ) > 0 ||
+                        !request->header("transfer-encoding").empty();
+        if ( !bHasBody ){
+            httpRequestReady( request.get() );
+            return true;
+        }
+        
+        // the body comes in on LWS_CALLBACK_HTTP_BODY
+        if ( isForm( request->header("content-type") ) ){
+            // lws-spa keeps the names array, so it lives in the request
+            std::vector<const char *> & names = request->fieldNames;
+            for (size_t i=0; i<request->route.fields.size(); i++){
+                names.push_back( request->route.fields[i].c_str() );
+            }
+            lws_spa_create_info_t info;
+            memset(&info, 0, sizeof info);
+            info.param_names = names.empty() ? NULL : &names[0];
+            info.count_params = (int) names.size();
+            info.max_storage = formStorage;
+            info.opt_cb = httpUpload;
+            info.opt_data = request.get();
+            request->spa = lws_spa_create_via_info(ws, &info);
+            if ( request->spa == NULL ){
+                ofLogError("ofxLibwebsockets") << "Could not set up a form decoder for " << url;
+                result = -1;
+            }
+        }
+        return true;
+    }
+    
+    //--------------------------------------------------------------
+    int Reactor::httpUpload( void * data, const char * name, const char * filename,
+                             char * buf, int len, enum lws_spa_fileupload_states state ){
+        HttpRequest & request = *(HttpRequest *) data;
+        if ( !request.route.onBody || ( state != LWS_UFS_CONTENT && state != LWS_UFS_FINAL_CONTENT ) ){
+            return 0;
+        }
+        HttpBodyChunk chunk;
+        chunk.field = name != NULL ? name : "";
+        chunk.filename = filename != NULL ? filename : "";
+        chunk.data = buf;
+        chunk.size = len;
+        chunk.bLast = state == LWS_UFS_FINAL_CONTENT;
+        request.route.onBody( request, chunk );
+        return 0;
+    }
+    
+    //--------------------------------------------------------------
+    int Reactor::_httpBody(struct lws *ws, ConnectionSession * session, const char * data, size_t len){
+        HttpRequest * request = session != NULL ? session->request : NULL;
+        if ( request == NULL ) return 0;
+        
+        if ( request->spa != NULL ){
+            return lws_spa_process(request->spa, data, (int) len) < 0 ? -1 : 0;
+        }
+        if ( request->route.onBody ){
+            HttpBodyChunk chunk;
+            chunk.data = data;
+            chunk.size = len;
+            chunk.bLast = false;
+            request->route.onBody( *request, chunk );
+        } else if ( !request->bTooLarge ){
+            if ( request->body.size() + len > request->route.maxBodySize ){
+                request->bTooLarge = true;
+                std::string().swap( request->body );
+            } else {
+                request->body.append( data, len );
+            }
+        }
+        return 0;
+    }
+    
+    //--------------------------------------------------------------
+    int Reactor::_httpBodyDone(struct lws *ws, ConnectionSession * session){
+        HttpRequest * request = session != NULL ? session->request : NULL;
+        if ( request == NULL ) return 0;
+        
+        if ( request->spa != NULL ){
+            lws_spa_finalize(request->spa);
+            for (size_t i=0; i<request->route.fields.size(); i++){
+                const char * value = lws_spa_get_string(request->spa, (int) i);
+                if ( value != NULL ){
+                    request->fields[ request->route.fields[i] ] = value;
+                }
+            }
+            lws_spa_destroy(request->spa);
+            request->spa = NULL;
+        } else if ( request->route.onBody ){
+            HttpBodyChunk chunk;
+            chunk.data = NULL;
+            chunk.size = 0;
+            chunk.bLast = true;
+            request->route.onBody( *request, chunk );
+        }
+        httpRequestReady( request );
+        return 0;
+    }
+    
+    //--------------------------------------------------------------
+    void Reactor::httpRequestReady( HttpRequest * request ){
+        if ( request->bTooLarge ){
+            request->respond( HTTP_STATUS_REQ_ENTITY_TOO_LARGE, "Request body too large" );
+        } else if ( request->route.onRequest ){
+            request->route.onRequest( request->self );
+        } else {
+            request->respond( HTTP_STATUS_NO_CONTENT, "", "" );
+        }
+        
+        // from now on respond() hands the response over to this thread
+        request->mutex.lock();
+        request->bHandled = true;
+        bool bResponded = request->bResponded;
+        request->mutex.unlock();
+        
+        if ( bResponded && request->ws != NULL ){
+            lws_callback_on_writable(request->ws);
+        }
+    }
+    
+    //--------------------------------------------------------------
+    void Reactor::_httpRespond(HttpRequestPtr request){
+        shards[request->shard]->serviceStates[request->tsi].httpResponses.push( request );
+        wake( request->shard, request->tsi );
+    }
+    
+    //--------------------------------------------------------------
+    int Reactor::httpRouteWritable( struct lws *ws, ConnectionSession * session ){
+        HttpRequest & request = *session->request;
+        // respond() doesn't touch the response once bResponded is set
+        if ( !request.isResponded() ) return 0;
+        
+        if ( !request.bHeadersSent ){
+            size_t size = 512;
+            for (size_t i=0; i<request.responseHeaders.size(); i++){
+                size += request.responseHeaders[i].first.size() + request.responseHeaders[i].second.size() + 4;
+            }
+            unsigned char * start = _sendBuffer( size, _shardIndex(ws), lws_get_tsi(ws) ) + LWS_PRE;
+            unsigned char * p = start;
+            unsigned char * end = start + size;
+            
+            if ( lws_add_http_common_headers(ws, request.status,
+                                             request.contentType.empty() ? NULL : request.contentType.c_str(),
+                                             request.responseBody.size(), &p, end) ){
+                return -1;
+            }
+            for (size_t i=0; i<request.responseHeaders.size(); i++){
+                // lws wants "name:", lower case for http/2
+                std::string name = ofToLower( request.responseHeaders[i].first ) + ":";
+                const std::string & value = request.responseHeaders[i].second;
+                if ( lws_add_http_header_by_name(ws, (const unsigned char *) name.c_str(),
+                                                 (const unsigned char *) value.c_str(), (int) value.size(), &p, end) ){
+                    return -1;
+                }
+            }
+            if ( lws_finalize_write_http_header(ws, start, &p, end) ){
+                return -1;
+            }
+            request.bHeadersSent = true;
+            
+            if ( !request.responseBody.empty() ){
+                lws_callback_on_writable(ws);
+                return 0;
+            }
+        } else {
+            int n = httpWriteBody(ws, request.responseBody, request.offset);
+            if ( n <= 0 ) return n;
+        }
+        
+        httpRelease( session );
+        // keep alive: the connection waits for the next request
+        return lws_http_transaction_completed(ws) ? -1 : 0;
+    }
+    
+    //--------------------------------------------------------------
+    void Reactor::httpRelease( ConnectionSession * session ){
+        if ( session == NULL || session->request == NULL ) return;
+        
+        HttpRequestPtr request;
+        request.swap( session->request->self );
+        session->request = NULL;
+        
+        request->mutex.lock();
+        request->bClosed = true;
+        request->mutex.unlock();
+        request->ws = NULL;
+        if ( request->spa != NULL ){
+            lws_spa_destroy(request->spa);
+            request->spa = NULL;
+        }
     }
 }
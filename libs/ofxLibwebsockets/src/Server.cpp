@@ -11,7 +11,99 @@
 #include "ofEvents.h"
 #include "ofUtils.h"
 
+#if !defined(TARGET_WIN32)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace ofxLibwebsockets {
+    
+    // additional lws service thread; runs Server::serviceLoop for its shard / tsi
+    class ServiceThread : public ofThread {
+    public:
+        ServiceThread( Server * _server, int _shard, int _tsi )
+        : server(_server), shard(_shard), tsi(_tsi){}
+        
+    protected:
+        void threadedFunction(){
+            server->serviceLoop( shard, tsi, *this );
+        }
+        
+        Server * server;
+        int shard;
+        int tsi;
+    };
+
+#if defined(SO_REUSEPORT)
+    // is iface an address (what we can bind to ourselves) rather than an
+    // interface name like "eth0"?
+    static bool isNumericAddress( const std::string & iface ){
+        unsigned char addr[sizeof(struct in6_addr)];
+        return inet_pton(AF_INET, iface.c_str(), addr) == 1 ||
+               inet_pton(AF_INET6, iface.c_str(), addr) == 1;
+    }
+    
+    // non-blocking listen socket that other sockets may bind to the same
+    // port, on the address lws would listen on: iface ("" == any, both IPv4
+    // and IPv6 when lws was built with IPv6)
+    static int openSharedListenSocket( const std::string & iface, int port ){
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+#if defined(LWS_WITH_IPV6)
+        hints.ai_family = AF_UNSPEC;
+#else
+        hints.ai_family = AF_INET;
+#endif
+        struct addrinfo * addrs = NULL;
+        std::string service = ofToString(port);
+        if ( getaddrinfo(iface.empty() ? NULL : iface.c_str(), service.c_str(), &hints, &addrs) != 0 ){
+            return -1;
+        }
+        
+        // any address: lws prefers a dual stack IPv6 socket, so do we
+        struct addrinfo * addr = addrs;
+        for (struct addrinfo * a = addrs; iface.empty() && a != NULL; a = a->ai_next){
+            if ( a->ai_family == AF_INET6 ) addr = a;
+        }
+        
+        int fd = socket(addr->ai_family, SOCK_STREAM, 0);
+        if ( fd < 0 && iface.empty() && addr->ai_family == AF_INET6 ){
+            // no IPv6 on this machine: IPv4 only
+            for (addr = addrs; addr != NULL && addr->ai_family != AF_INET; addr = addr->ai_next);
+            if ( addr != NULL ) fd = socket(addr->ai_family, SOCK_STREAM, 0);
+        }
+        if ( fd < 0 ){
+            freeaddrinfo(addrs);
+            return -1;
+        }
+        
+        int on = 1;
+        int off = 0;
+        bool bOk = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == 0 &&
+                   setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == 0 &&
+                   ( addr->ai_family != AF_INET6 || !iface.empty() ||
+                     setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off) == 0 ) &&
+                   bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+                   listen(fd, SOMAXCONN) == 0 &&
+                   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == 0;
+        freeaddrinfo(addrs);
+        if ( !bOk ){
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    
+    // accepts per wakeup of a shard's listen socket, so a burst of new
+    // connections can't starve the sockets that shard already serves
+    static const int maxAcceptsPerWakeup = 32;
+#endif
 
 	ServerOptions defaultServerOptions(){
         ServerOptions opts;
@@ -21,21 +113,126 @@ namespace ofxLibwebsockets {
         opts.sslCertPath    = ofToDataPath("ssl/libwebsockets-test-server.pem", true);
         opts.sslKeyPath     = ofToDataPath("ssl/libwebsockets-test-server.key.pem", true);
         opts.documentRoot   = ofToDataPath("web", true);
+        opts.bEventDriven   = false;
+        opts.bMainThreadEvents  = false;
+        opts.highWatermark      = 0;
+        opts.lowWatermark       = 0;
+        opts.slowConsumer       = SlowConsumerPolicy();   // off
+        opts.rxBufferSize       = OFX_LWS_MAX_BUFFER;
+        opts.txPacketSize       = 0;
+        opts.maxFragmentSize    = OFX_LWS_MAX_FRAGMENT;
+        opts.minFragmentSize    = OFX_LWS_MIN_FRAGMENT;
+        opts.bAdaptiveFragments = false;
+        opts.deflate            = DeflateOptions();     // off
+        opts.bHttpCache         = false;
+        opts.bHttpPreload       = false;
+        opts.bHttpWatch         = false;
+        opts.httpCacheMaxFileSize = 4 * 1024 * 1024;
+        opts.mounts.clear();
+        opts.serviceThreads = 1;
+        opts.shards         = 1;
+        opts.dispatchThreads    = 0;
+        opts.dispatchQueueSize  = 1024;
         opts.ka_time        = 0;
         opts.ka_probes      = 0;
         opts.ka_interval    = 0;
         return opts;
     }
 
+    //--------------------------------------------------------------
+    // lws only knows a handful of content types (no video...), and refuses
+    // to serve a file it has none for: give it every one HttpCache knows
+    static const struct lws_protocol_vhost_options * mountMimeTypes(){
+        static std::vector<std::string> names;
+        static std::vector<struct lws_protocol_vhost_options> types;
+        if ( types.empty() ){
+            const std::unordered_map<std::string, std::string> & known = HttpCache::mimeTypes();
+            names.reserve( known.size() );
+            types.resize( known.size() );
+            size_t i = 0;
+            for (std::unordered_map<std::string, std::string>::const_iterator it = known.begin(); it != known.end(); ++it, ++i){
+                names.push_back( "." + it->first );
+                memset(&types[i], 0, sizeof types[i]);
+                types[i].next = i + 1 < types.size() ? &types[i + 1] : NULL;
+                types[i].name = names[i].c_str();
+                types[i].value = it->second.c_str();
+            }
+        }
+        return types.empty() ? NULL : &types[0];
+    }
+    
     //--------------------------------------------------------------
     Server::Server(){
         context = NULL;
         waitMillis = 1;
-        reactors.push_back(this);
         
         defaultOptions = defaultServerOptions();      
     }
     
+    //--------------------------------------------------------------
+    void Server::addRoute( const HttpRoute & route ){
+        routes.push_back( route );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::onGet( const string & path, std::function<void(HttpRequestPtr)> handler ){
+        HttpRoute route;
+        route.method = "GET";
+        route.path = path;
+        route.onRequest = handler;
+        addRoute( route );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::onPost( const string & path, std::function<void(HttpRequestPtr)> handler,
+                         const vector<string> & fields ){
+        HttpRoute route;
+        route.method = "POST";
+        route.path = path;
+        route.fields = fields;
+        route.onRequest = handler;
+        addRoute( route );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::setupMounts( struct lws_context_creation_info & info ){
+        lwsMounts.clear();
+        
+        vector<HttpMount> & mounts = defaultOptions.mounts;
+        for (size_t i=0; i<mounts.size(); i++){
+            HttpMount & mount = mounts[i];
+            // lws wants "/clips", not "/clips/"
+            while ( mount.urlPrefix.size() > 1 && mount.urlPrefix[mount.urlPrefix.size() - 1] == '/' ){
+                mount.urlPrefix.erase( mount.urlPrefix.size() - 1 );
+            }
+            if ( mount.urlPrefix.empty() || mount.urlPrefix[0] != '/' || mount.urlPrefix.size() > 255 || mount.documentRoot.empty() ){
+                ofLogWarning("Server") << "Ignoring mount \"" << mount.urlPrefix << "\" -> \"" << mount.documentRoot << "\"";
+                continue;
+            }
+            
+            struct lws_http_mount m;
+            memset(&m, 0, sizeof m);
+            m.mountpoint = mount.urlPrefix.c_str();
+            m.mountpoint_len = (unsigned char) mount.urlPrefix.size();
+            m.origin = mount.documentRoot.c_str();
+            m.origin_protocol = LWSMPRO_FILE;
+            m.def = mount.defaultFile.empty() ? NULL : mount.defaultFile.c_str();
+            m.extra_mimetypes = mountMimeTypes();
+            m.cache_max_age = mount.cacheMaxAge;
+            m.cache_reusable = mount.bCacheReusable;
+            m.cache_revalidate = mount.bCacheRevalidate;
+            m.cache_intermediaries = mount.bCacheIntermediaries;
+            lwsMounts.push_back( m );
+            
+            ofLogVerbose("Server") << "Mounted " << mount.documentRoot << " at " << mount.urlPrefix;
+        }
+        
+        for (size_t i=0; i + 1 < lwsMounts.size(); i++){
+            lwsMounts[i].mount_next = &lwsMounts[i + 1];
+        }
+        info.mounts = lwsMounts.empty() ? NULL : &lwsMounts[0];
+    }
+    
     //--------------------------------------------------------------
     Server::~Server(){
         ofLogVerbose() << "Server destructor...";
@@ -79,7 +276,14 @@ namespace ofxLibwebsockets {
         defaultOptions = options;
         
         port = defaultOptions.port = options.port;
+        bEventDriven = defaultOptions.bEventDriven;
+        setMainThreadEvents( defaultOptions.bMainThreadEvents );
+        setWatermarks( defaultOptions.highWatermark, defaultOptions.lowWatermark );
+        setSlowConsumerPolicy( defaultOptions.slowConsumer );
         document_root = defaultOptions.documentRoot = options.documentRoot;
+        bHttpCache = defaultOptions.bHttpCache;
+        httpCache.setup( document_root, bHttpCache && defaultOptions.bHttpPreload,
+                         defaultOptions.bHttpWatch, defaultOptions.httpCacheMaxFileSize );
         
         // NULL protocol is required by LWS
         struct lws_protocols null_protocol = { NULL, NULL, 0 };
@@ -88,17 +292,17 @@ namespace ofxLibwebsockets {
         lws_protocols.clear();
         
         //register main protocol
+        serverProtocol.rx_buffer_size = options.rxBufferSize;
+        serverProtocol.tx_packet_size = options.txPacketSize;
+        serverProtocol.max_fragment_size = options.maxFragmentSize;
+        serverProtocol.min_fragment_size = options.minFragmentSize;
+        serverProtocol.bAdaptiveFragments = options.bAdaptiveFragments;
         registerProtocol( options.protocol, serverProtocol );
         
         //register any added protocols
         for (size_t i=0; i < protocols.size(); ++i){
-            struct lws_protocols lws_protocol = {
-                ( protocols[i].first == "NULL" ? NULL : protocols[i].first.c_str() ),
-                        lws_callback,
-                        protocols[i].second->rx_buffer_size,
-                        protocols[i].second->rx_buffer_size
-            };
-            lws_protocols.push_back(lws_protocol);
+            // each socket's Connection lives in its per session data
+            lws_protocols.push_back( makeLwsProtocol(i, lws_callback, sizeof(ConnectionSession)) );
         }
         lws_protocols.push_back(null_protocol);
         
@@ -114,8 +318,10 @@ namespace ofxLibwebsockets {
         struct lws_context_creation_info info;
         memset(&info, 0, sizeof info);
         info.port = port;
+        info.iface = interfaceStr.empty() ? NULL : interfaceStr.c_str();
         info.protocols = &lws_protocols[0];
-        info.extensions = NULL;
+        info.extensions = setupExtensions( defaultOptions.deflate );
+        setupMounts( info );
         info.ssl_cert_filepath = sslCert;
         info.ssl_private_key_filepath = sslKey;
         info.gid = -1;
@@ -133,43 +339,126 @@ namespace ofxLibwebsockets {
             info.ka_probes = options.ka_probes;
             info.ka_interval = options.ka_interval;
         }        
-
-        context = lws_create_context(&info);
         
-        if (context == NULL){
-            ofLogError("Server") << "[ofxLibwebsockets] libwebsockets init failed";
-            return false;
-        } else {
-            ofLogNotice("Server") << "New Server on port " << port << "...";
-            startThread(); // blocking, non-verbose        
-            return true;
+        if ( options.serviceThreads > LWS_MAX_SMP ){
+            ofLogWarning("Server") << "libwebsockets was built with LWS_MAX_SMP " << LWS_MAX_SMP
+                                   << ", using " << LWS_MAX_SMP << " service thread(s)";
+        }
+        info.count_threads = ofClamp( options.serviceThreads, 1, LWS_MAX_SMP );
+        
+        int numShards = max( options.shards, 1 );
+#if !defined(SO_REUSEPORT)
+        if ( numShards > 1 ){
+            ofLogWarning("Server") << "SO_REUSEPORT isn't available on this platform, using 1 shard";
+            numShards = 1;
+        }
+#else
+        if ( numShards > 1 && !interfaceStr.empty() && !isNumericAddress(interfaceStr) ){
+            ofLogWarning("Server") << "Shards need a listen address, not an interface name (" << interfaceStr << "), using 1 shard";
+            numShards = 1;
+        }
+#endif
+        if ( numShards > 1 ){
+            // lws only sets SO_REUSEPORT on its own listen socket when a
+            // context runs several service threads, so each shard gets a
+            // listen socket from us instead (see _acceptShared)
+            info.port = CONTEXT_PORT_NO_LISTEN_SERVER;
         }
+        
+        for (int shard=0; shard<numShards; shard++){
+            if ( createContext(info, shard) == NULL ){
+                ofLogError("Server") << "[ofxLibwebsockets] libwebsockets init failed";
+                destroyContexts();
+                return false;
+            }
+#if defined(SO_REUSEPORT)
+            if ( numShards > 1 ){
+                lws_sock_file_fd_type fd;
+                fd.filefd = openSharedListenSocket( interfaceStr, port );
+                if ( fd.filefd < 0 ){
+                    ofLogError("Server") << "[ofxLibwebsockets] could not listen on port " << port;
+                    destroyContexts();
+                    return false;
+                }
+                // lws watches it like any other descriptor and calls us
+                // back with LWS_CALLBACK_RAW_RX_FILE when it can accept
+                struct lws_vhost * vhost = lws_get_vhost_by_name( shards[shard]->context, "default" );
+                if ( vhost == NULL || lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd, NULL, NULL) == NULL ){
+                    ofLogError("Server") << "[ofxLibwebsockets] could not watch the listen socket of shard " << shard;
+                    destroyContexts();
+                    return false;
+                }
+            }
+#endif
+        }
+        
+        ofLogNotice("Server") << "New Server on port " << port << "..."
+                              << ( numShards > 1 ? " (" + ofToString(numShards) + " shards)" : "" );
+        if ( options.dispatchThreads > 0 && !options.bMainThreadEvents ){
+            dispatcher.start( this, options.dispatchThreads, options.dispatchQueueSize );
+        }
+        
+        startThread(); // blocking, non-verbose        
+        
+        for (int shard=0; shard<numShards; shard++){
+            int count = lws_get_count_threads(shards[shard]->context);
+            for (int tsi=0; tsi<count; tsi++){
+                if ( shard == 0 && tsi == 0 ) continue;
+                extraServiceThreads.push_back( new ServiceThread(this, shard, tsi) );
+                extraServiceThreads.back()->startThread();
+            }
+        }
+        return true;
     }
     
     //--------------------------------------------------------------
     void Server::close() {
         ofLogNotice("Server") << "Server is closing...";
-        lws_cancel_service(context);
+        for (size_t i=0; i<extraServiceThreads.size(); i++){
+            extraServiceThreads[i]->stopThread();
+        }
         if (isThreadRunning()){
             stopThread();
+        }
+        // kick the service threads out of their poll wait so they see the stop flag
+        for (size_t i=0; i<shards.size(); i++){
+            if ( shards[i]->context != NULL ) lws_cancel_service(shards[i]->context);
+        }
+        for (size_t i=0; i<extraServiceThreads.size(); i++){
+            extraServiceThreads[i]->waitForThread(false,5000);
+            delete extraServiceThreads[i];
+        }
+        extraServiceThreads.clear();
+        if (isThreadRunning()){
             ofSleepMillis(10);
             waitForThread(false,5000);
             ofLogNotice("Server") << "Thread stopped...";
         }
-        lws_context_destroy(context);
+        destroyContexts();
+        
+        // after the contexts: closing connections still deliver their messages
+        dispatcher.stop();
+        drainEvents();
     }
     
     //--------------------------------------------------------------
     void Server::send( string message ){
+        sendConflated( message, OFX_LWS_NO_CONFLATION );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::sendConflated( const string & message, unsigned int key ){
         bool bFound = false;
         int index = 0;
+        lock();
         for (size_t i=0; i<connections.size(); i++){
             if ( connections[i] ){
-                connections[i]->send( message );
+                connections[i]->sendConflated( message, key );
                 bFound = true;
                 index = (int)i;
             }
         }
+        unlock();
         if ( !bFound ) {
             ofLogError("Server") << "Connection not found at index " << index;
         }
@@ -187,24 +476,44 @@ namespace ofxLibwebsockets {
     
     //--------------------------------------------------------------
     void Server::sendBinary( char * data, int size ){
+        if ( size <= 0 ) return;
+        
+        // one copy, shared by every connection's queue
+        sendBinary( Connection::makePayload(data, size), size );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::sendBinary( const SharedPayload & data, int size ){
+        sendBinaryConflated( data, size, OFX_LWS_NO_CONFLATION );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::sendBinaryConflated( char * data, int size, unsigned int key ){
+        if ( size <= 0 ) return;
+        sendBinaryConflated( Connection::makePayload(data, size), size, key );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::sendBinaryConflated( const SharedPayload & data, int size, unsigned int key ){
+        lock();
         for (size_t i=0; i<connections.size(); i++){
             if ( connections[i] ){
-                connections[i]->sendBinary( data, size );
+                connections[i]->sendBinaryConflated( data, size, key );
             }
         }
+        unlock();
     }
     
     //--------------------------------------------------------------
     bool Server::send( string message, string ip ){
         bool bFound = false;
-        for (size_t i=0; i<connections.size(); i++){
-            if ( connections[i] ){
-                if ( connections[i]->getClientIP() == ip ){
-                    connections[i]->send( message );
-                    bFound = true;
-                }
-            }
+        lock();
+        const vector<Connection *> & atIP = connections.getByIP( ip );
+        for (size_t i=0; i<atIP.size(); i++){
+            atIP[i]->send( message );
+            bFound = true;
         }
+        unlock();
         if ( !bFound ) {
             ofLogError("Server") << "Connection not found at this IP!";
             return false;
@@ -212,6 +521,22 @@ namespace ofxLibwebsockets {
         return true;
     }
     
+    //--------------------------------------------------------------
+    void Server::_acceptShared( struct lws *ws ){
+#if defined(SO_REUSEPORT)
+        // runs on the shard's own service thread, so adopting is safe
+        int listenfd = lws_get_socket_fd(ws);
+        // more waiting after that: lws calls us again on its next poll
+        int fd;
+        for (int i=0; i<maxAcceptsPerWakeup && (fd = accept(listenfd, NULL, NULL)) >= 0; i++){
+            // closes fd if it fails
+            if ( lws_adopt_socket( lws_get_context(ws), fd ) == NULL ){
+                ofLogWarning("Server") << "Could not adopt accepted socket";
+            }
+        }
+#endif
+    }
+    
     //getters
     //--------------------------------------------------------------
     int Server::getPort(){
@@ -231,15 +556,22 @@ namespace ofxLibwebsockets {
     //--------------------------------------------------------------
     void Server::threadedFunction()
     {
-        while (isThreadRunning())
+        serviceLoop( 0, 0, *this );
+    }
+    
+    //--------------------------------------------------------------
+    void Server::serviceLoop( int shard, int tsi, ofThread & thread )
+    {
+        struct lws_context * shardContext = shards[shard]->context;
+        
+        while (thread.isThreadRunning())
         {            
-            // update all connections
-            for (size_t i=0; i<connections.size(); i++){
-                if ( connections[i] ){
-                    connections[i]->update();
-                }
+            // update connections that have something new to send; in event
+            // driven mode this happens on EVENT_WAIT_CANCELLED instead
+            if ( !bEventDriven ){
+                _servicePending( shard, tsi );
             }
-            for (size_t i=0; i<protocols.size(); ++i){
+            for (size_t i=0; shard == 0 && tsi == 0 && i<protocols.size(); ++i){
                 if (protocols[i].second != NULL){
                     //lock();
                     protocols[i].second->execute();
@@ -247,15 +579,15 @@ namespace ofxLibwebsockets {
                 }
             }
             
-            if (lock())
-            {
-                int n = lws_service(context, -1);
-                if(n < 0) {
-                    ofLogError() << "lws_service returned an error: " << n;
-                }
-                unlock();
+            // 0 == sleep until socket activity or lws_cancel_service()
+            // -1 == return immediately
+            int n = lws_service_tsi(shardContext, bEventDriven ? 0 : -1, tsi);
+            if(n < 0) {
+                ofLogError() << "lws_service returned an error: " << n;
+            }
+            if ( !bEventDriven ){
+                ofSleepMillis(1);
             }
-            ofSleepMillis(1);
         }
     }
 
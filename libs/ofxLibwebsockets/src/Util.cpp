@@ -7,23 +7,11 @@ int lws_client_callback(struct lws* ws, enum lws_callback_reasons reason, void*
     const struct lws_protocols* lws_protocol = (ws == NULL ? NULL : lws_get_protocol(ws));
     int idx = lws_protocol ? lws_protocol->id : 0;
 
-    Connection* conn;
-
-    Reactor* reactor = NULL;
-    Protocol* protocol;
-
-            for (int i=0; i<(int)reactors.size(); i++){
-                //if (reactors[i]->getContext() == context)
-                {
-                    reactor =  reactors[i];
-                    protocol = reactor->protocol(idx);
-                    conn = ((Client*) reactor)->getConnection();
-                    if (conn){
-                    //	conn->context = context;
-                    }
-                    break;
-                }
-            }
+    // the context's user data leads back to the Client that owns it, and
+    // the client wsi carries its Connection as opaque user data
+    Reactor* reactor = Reactor::_reactorFor(ws);
+    Protocol* protocol = reactor != NULL ? reactor->protocol(idx) : NULL;
+    Connection* conn = ws != NULL ? (Connection*)lws_get_opaque_user_data(ws) : NULL;
 
     if(reason != LWS_CALLBACK_GET_THREAD_ID) {
         ofLogVerbose("ofxLibwebsockets") << getCallbackReason(reason);
@@ -40,13 +28,19 @@ int lws_client_callback(struct lws* ws, enum lws_callback_reasons reason, void*
     case LWS_CALLBACK_CLIENT_CONFIRM_EXTENSION_SUPPORTED:
     case LWS_CALLBACK_PROTOCOL_INIT: // this may be useful, says we're OK to allocate protocol data
     case LWS_CALLBACK_WSI_CREATE:
-    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
     case LWS_CALLBACK_HTTP_BODY_COMPLETION:
     case LWS_CALLBACK_HTTP_FILE_COMPLETION:
     case LWS_CALLBACK_HTTP_WRITEABLE:
     case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
         return 0;
 
+    // a send() from another thread woke up lws_service()
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+        if (reactor != NULL) {
+            reactor->_servicePending();
+        }
+        return 0;
+
     // check if we allow this connection (default is always yes)
     case LWS_CALLBACK_FILTER_HTTP_CONNECTION:
     case LWS_CALLBACK_FILTER_NETWORK_CONNECTION:
@@ -117,18 +111,11 @@ int lws_callback(struct lws* ws, enum lws_callback_reasons reason, void* user, v
         return 1;
     }
 
-    Connection* conn;
-    Connection** conn_ptr = (Connection**)user;
-    Server* reactor = NULL;
-    Protocol* protocol = NULL;
-
-    for (int i = 0; i < (int)reactors.size(); i++) {
-        {
-            reactor = (Server*)reactors[i];
-            protocol = reactor->protocol((idx > 0 ? idx : 0));
-            break;
-        }
-    }
+    Connection* conn = NULL;
+    ConnectionSession* session = (ConnectionSession*)user;
+    // lws_callback is only ever registered by Servers
+    Server* reactor = (Server*)Reactor::_reactorFor(ws);
+    Protocol* protocol = reactor != NULL ? reactor->protocol(idx) : NULL;
 
     if(reason != LWS_CALLBACK_GET_THREAD_ID) {
         ofLog(OF_LOG_VERBOSE, "[ofxLibwebsockets] " + getCallbackReason(reason));
@@ -138,29 +125,77 @@ int lws_callback(struct lws* ws, enum lws_callback_reasons reason, void* user, v
         // server completed handshake, need to ask for next "writable" callback
         lws_callback_on_writable(ws);
 
-        // now is when you can set the "user" data,
-        // which we use to instantiate / refer to the ofxLibwebsockets::Connection
-        if (reactor != NULL) {
-            *conn_ptr = new Connection(reactor, protocol);
+        // now is when you can set the "user" data: construct the
+        // ofxLibwebsockets::Connection in the per-session memory lws gave us
+        if (reactor != NULL && session != NULL && session->conn == NULL) {
+            reactor->_openSession(session, protocol);
         }
-    } else if (reason == LWS_CALLBACK_CLOSED) {
-        //if (*conn_ptr != NULL)
-        //delete *conn_ptr;
     }
 
     switch (reason) {
+    // a send() from another thread woke up lws_service()
+    // (this arrives once on every service thread)
     case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+        if (reactor != NULL) {
+            reactor->_servicePending(Reactor::_shardIndex(ws), lws_get_tsi(ws));
+        }
+        break;
+
+    // connections are waiting on a shard's SO_REUSEPORT listen socket
+    case LWS_CALLBACK_RAW_RX_FILE:
+        if (reactor != NULL) {
+            reactor->_acceptShared(ws);
+        }
+        break;
+
+    case LWS_CALLBACK_RAW_ADOPT_FILE:
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
     case LWS_CALLBACK_HTTP_BIND_PROTOCOL:
-    case LWS_CALLBACK_CLOSED_HTTP:
-    case LWS_CALLBACK_WSI_DESTROY:
-    case LWS_CALLBACK_HTTP_DROP_PROTOCOL:
     case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
-    case LWS_CALLBACK_HTTP_BODY_COMPLETION:
     case LWS_CALLBACK_HTTP_FILE_COMPLETION:
-    case LWS_CALLBACK_HTTP_WRITEABLE:
     case LWS_CALLBACK_CLIENT_CONFIRM_EXTENSION_SUPPORTED:
         break;
 
+    // request body for a dynamic route, as it arrives
+    case LWS_CALLBACK_HTTP_BODY:
+        if (reactor != NULL) {
+            return reactor->_httpBody(ws, session, (const char*)data, len);
+        }
+        break;
+
+    case LWS_CALLBACK_HTTP_BODY_COMPLETION:
+        if (reactor != NULL) {
+            return reactor->_httpBodyDone(ws, session);
+        }
+        break;
+
+    // next chunk of a cached file or route response
+    case LWS_CALLBACK_HTTP_WRITEABLE:
+        if (reactor != NULL) {
+            return reactor->_httpWritable(ws, session);
+        }
+        break;
+
+    // the session memory goes away (or to another protocol after an upgrade)
+    case LWS_CALLBACK_CLOSED_HTTP:
+    case LWS_CALLBACK_HTTP_DROP_PROTOCOL:
+        if (reactor != NULL) {
+            reactor->_httpClosed(session);
+        }
+        break;
+
+    // last callback for this socket: lws frees the session memory after
+    // this, so release the Connection deterministically
+    case LWS_CALLBACK_WSI_DESTROY:
+        if (reactor != NULL) {
+            reactor->_httpClosed(session);
+        }
+        if (reactor != NULL && session != NULL && session->conn != NULL) {
+            reactor->_notify(session->conn, reason, (char*)data, len);
+            reactor->_closeSession(session);
+        }
+        break;
+
     case LWS_CALLBACK_FILTER_HTTP_CONNECTION:
         if (protocol != NULL) {
             // return 0 == allow, 1 == block
@@ -174,7 +209,7 @@ int lws_callback(struct lws* ws, enum lws_callback_reasons reason, void* user, v
         return 0;
 
     case LWS_CALLBACK_HTTP:
-        return reactor->_http(ws, (char*)data);
+        return reactor->_http(ws, (char*)data, session);
 
         // we're not really worried about this at the moment
     case LWS_CALLBACK_ADD_POLL_FD:
@@ -196,8 +231,9 @@ int lws_callback(struct lws* ws, enum lws_callback_reasons reason, void* user, v
     case LWS_CALLBACK_RECEIVE: // server receive
     case LWS_CALLBACK_CLIENT_RECEIVE: // client receive
     case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
-        if (user != NULL) {
-            conn = *(Connection**)user;
+    case LWS_CALLBACK_TIMER:
+        if (session != NULL) {
+            conn = session->conn;
         }
         if (conn != NULL && (conn->ws != ws || conn->ws == NULL)) {
             conn->ws = ws;